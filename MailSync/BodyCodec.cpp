@@ -0,0 +1,107 @@
+//
+//  BodyCodec.cpp
+//  MailSync
+//
+//  Created by agent on 10/17/26.
+//  Copyright © 2026 Foundry 376. All rights reserved.
+//
+//  Use of this file is subject to the terms and conditions defined
+//  in 'LICENSE.md', which is part of the Mailspring-Sync package.
+//
+
+#include "BodyCodec.hpp"
+#include "SyncException.hpp"
+
+#include <zlib.h>
+
+/*
+ Preset deflate dictionary for BODY_CODEC_DEFLATE_DICT_V1. Bodies are short
+ compared to deflate's 32KB window, so most of the savings on a small message
+ come from back-references into this dictionary. It's made of markup that's common
+ in sanitized mail HTML, with the most frequent strings last (closest to the data).
+ Never modify it - add a new codec tag instead.
+ */
+static const char BODY_DICTIONARY_V1[] =
+    "<!DOCTYPE html PUBLIC \"-//W3C//DTD XHTML 1.0 Transitional//EN\" \"http://www.w3.org/TR/xhtml1/DTD/xhtml1-transitional.dtd\">"
+    "<html xmlns=\"http://www.w3.org/1999/xhtml\"><head><meta http-equiv=\"Content-Type\" content=\"text/html; charset=utf-8\">"
+    "<meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0\"><title></title><style type=\"text/css\">"
+    "@media only screen and (max-width: 600px) { </style></head><body>"
+    "<p class=\"MsoNormal\"><span style=\"font-size:11.0pt;font-family:&quot;Calibri&quot;,sans-serif;color:#1F497D\">&nbsp;</span></p>"
+    "<blockquote class=\"gmail_quote\" style=\"margin:0px 0px 0px 0.8ex;border-left:1px solid rgb(204,204,204);padding-left:1ex\">"
+    "<div class=\"gmail_quote\"><div dir=\"ltr\" class=\"gmail_attr\">On wrote:<br></div>"
+    "<table role=\"presentation\" width=\"100%\" cellpadding=\"0\" cellspacing=\"0\" border=\"0\" align=\"center\" bgcolor=\"#ffffff\">"
+    "<tbody><tr><td align=\"center\" valign=\"top\" class=\"\" width=\"600\" height=\"1\">"
+    "<img src=\"https://\" alt=\"\" width=\"\" height=\"\" border=\"0\" style=\"display:block;border:0;outline:none;text-decoration:none;\" />"
+    "<a href=\"https://\" target=\"_blank\" rel=\"noopener noreferrer\" style=\"color:#\">unsubscribe</a>"
+    " style=\"font-family:Helvetica,Arial,sans-serif;font-size:14px;line-height:20px;color:#333333;font-weight:normal;"
+    "padding:0px;margin:0px;mso-line-height-rule:exactly;background-color:#ffffff;border-collapse:collapse;text-align:left;\">"
+    "</td></tr></tbody></table></td></tr></table></div></body></html>"
+    "<div><br></div><div dir=\"ltr\"><div></div></div><span></span><br><br>&nbsp;</p>\n<p>"
+    "</a></span></td></tr><tr><td style=\"";
+
+static uint32_t readLength(const uint8_t * bytes) {
+    return (uint32_t)bytes[1] | ((uint32_t)bytes[2] << 8) | ((uint32_t)bytes[3] << 16) | ((uint32_t)bytes[4] << 24);
+}
+
+vector<uint8_t> BodyCodec::compress(const string & body) {
+    z_stream stream{};
+    if (deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        throw SyncException("zlib", "BodyCodec::compress - deflateInit", false);
+    }
+    deflateSetDictionary(&stream, (const Bytef *)BODY_DICTIONARY_V1, sizeof(BODY_DICTIONARY_V1) - 1);
+
+    uint32_t length = (uint32_t)body.length();
+    vector<uint8_t> result(BODY_CODEC_HEADER_SIZE + deflateBound(&stream, length));
+    result[0] = BODY_CODEC_DEFLATE_DICT_V1;
+    result[1] = length & 0xFF;
+    result[2] = (length >> 8) & 0xFF;
+    result[3] = (length >> 16) & 0xFF;
+    result[4] = (length >> 24) & 0xFF;
+
+    stream.next_in = (Bytef *)body.data();
+    stream.avail_in = length;
+    stream.next_out = result.data() + BODY_CODEC_HEADER_SIZE;
+    stream.avail_out = (uInt)(result.size() - BODY_CODEC_HEADER_SIZE);
+    int status = deflate(&stream, Z_FINISH);
+    deflateEnd(&stream);
+    if (status != Z_STREAM_END) {
+        throw SyncException("zlib", "BodyCodec::compress - deflate", false);
+    }
+    result.resize(BODY_CODEC_HEADER_SIZE + stream.total_out);
+    return result;
+}
+
+string BodyCodec::dictionary(int tag) {
+    if (tag != BODY_CODEC_DEFLATE_DICT_V1) {
+        throw SyncException("zlib", "BodyCodec::dictionary - unknown codec", false);
+    }
+    return string(BODY_DICTIONARY_V1, sizeof(BODY_DICTIONARY_V1) - 1);
+}
+
+string BodyCodec::decompress(const void * bytes, int length) {
+    const uint8_t * b = (const uint8_t *)bytes;
+    if (length < BODY_CODEC_HEADER_SIZE || b[0] != BODY_CODEC_DEFLATE_DICT_V1) {
+        throw SyncException("zlib", "BodyCodec::decompress - unknown codec", false);
+    }
+
+    z_stream stream{};
+    if (inflateInit(&stream) != Z_OK) {
+        throw SyncException("zlib", "BodyCodec::decompress - inflateInit", false);
+    }
+    string result(readLength(b), '\0');
+    stream.next_in = (Bytef *)(b + BODY_CODEC_HEADER_SIZE);
+    stream.avail_in = (uInt)(length - BODY_CODEC_HEADER_SIZE);
+    stream.next_out = (Bytef *)&result[0];
+    stream.avail_out = (uInt)result.length();
+
+    int status = inflate(&stream, Z_FINISH);
+    if (status == Z_NEED_DICT) {
+        inflateSetDictionary(&stream, (const Bytef *)BODY_DICTIONARY_V1, sizeof(BODY_DICTIONARY_V1) - 1);
+        status = inflate(&stream, Z_FINISH);
+    }
+    inflateEnd(&stream);
+    if (status != Z_STREAM_END || stream.total_out != result.length()) {
+        throw SyncException("zlib", "BodyCodec::decompress - inflate", false);
+    }
+    return result;
+}
@@ -0,0 +1,45 @@
+//
+//  BodyCodec.hpp
+//  MailSync
+//
+//  Created by agent on 10/17/26.
+//  Copyright © 2026 Foundry 376. All rights reserved.
+//
+//  Use of this file is subject to the terms and conditions defined
+//  in 'LICENSE.md', which is part of the Mailspring-Sync package.
+//
+
+#ifndef BodyCodec_hpp
+#define BodyCodec_hpp
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/*
+ Compressed MessageBody values are stored as BLOBs, while uncompressed values
+ remain TEXT. A compressed value begins with a one byte codec tag and the
+ uncompressed length (uint32, little endian), followed by the payload.
+
+ The codec tag identifies both the algorithm and the preset dictionary, so the
+ dictionary for a tag must never change. Add a new tag to use a new dictionary.
+
+ For BODY_CODEC_DEFLATE_DICT_V1 the payload is a zlib stream (RFC 1950) that
+ needs the preset dictionary. Readers outside mailsync can inflate it with any
+ zlib binding (eg: Node's zlib.inflateSync(payload, {dictionary})), using the
+ dictionary stored for the tag in the BodyCodecDictionary table.
+ */
+#define BODY_CODEC_HEADER_SIZE      5
+#define BODY_CODEC_DEFLATE_DICT_V1  1
+
+class BodyCodec {
+public:
+    static vector<uint8_t> compress(const string & body);
+    static string decompress(const void * bytes, int length);
+    static string dictionary(int tag);
+};
+
+#endif /* BodyCodec_hpp */
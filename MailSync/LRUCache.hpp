@@ -0,0 +1,87 @@
+//
+//  LRUCache.hpp
+//  MailSync
+//
+//  Created by agent on 10/17/26.
+//  Copyright © 2026 Foundry 376. All rights reserved.
+//
+//  Use of this file is subject to the terms and conditions defined
+//  in 'LICENSE.md', which is part of the Mailspring-Sync package.
+//
+
+#ifndef LRUCache_hpp
+#define LRUCache_hpp
+
+#include <stdio.h>
+#include <list>
+#include <unordered_map>
+
+using namespace std;
+
+/*
+ A small bounded least-recently-used map. Lookups move the entry to the
+ front of the list and inserts evict the entry at the back once `capacity`
+ is exceeded. Not thread safe - like MailStore, each instance is expected
+ to be owned by a single worker thread.
+ */
+template<typename K, typename V>
+class LRUCache {
+    typedef pair<K, V> Entry;
+
+    list<Entry> _entries;
+    unordered_map<K, typename list<Entry>::iterator> _index;
+    size_t _capacity;
+
+public:
+    LRUCache(size_t capacity) : _capacity(capacity) {
+    }
+
+    V * get(const K & key) {
+        auto it = _index.find(key);
+        if (it == _index.end()) {
+            return nullptr;
+        }
+        _entries.splice(_entries.begin(), _entries, it->second);
+        return &(it->second->second);
+    }
+
+    void put(const K & key, V value) {
+        auto it = _index.find(key);
+        if (it != _index.end()) {
+            it->second->second = value;
+            _entries.splice(_entries.begin(), _entries, it->second);
+            return;
+        }
+        _entries.emplace_front(key, value);
+        _index[key] = _entries.begin();
+
+        if (_entries.size() > _capacity) {
+            _index.erase(_entries.back().first);
+            _entries.pop_back();
+        }
+    }
+
+    void erase(const K & key) {
+        auto it = _index.find(key);
+        if (it == _index.end()) {
+            return;
+        }
+        _entries.erase(it->second);
+        _index.erase(it);
+    }
+
+    void clear() {
+        _index.clear();
+        _entries.clear();
+    }
+
+    size_t size() {
+        return _entries.size();
+    }
+
+    size_t capacity() {
+        return _capacity;
+    }
+};
+
+#endif /* LRUCache_hpp */
@@ -0,0 +1,156 @@
+//
+//  LabelSnapshot.cpp
+//  MailSync
+//
+//  Created by agent on 10/17/26.
+//  Copyright © 2026 Foundry 376. All rights reserved.
+//
+//  Use of this file is subject to the terms and conditions defined
+//  in 'LICENSE.md', which is part of the Mailspring-Sync package.
+//
+
+#include "LabelSnapshot.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <algorithm>
+
+#include "spdlog/spdlog.h"
+
+typedef map<string, shared_ptr<const LabelSnapshot>> LabelSnapshotMap;
+
+// Readers atomically load the current map. Writers copy it, modify the copy and
+// atomically swap it in, serialized by sharedSnapshotsMtx.
+static shared_ptr<const LabelSnapshotMap> sharedSnapshots = make_shared<LabelSnapshotMap>();
+static std::mutex sharedSnapshotsMtx;
+static std::atomic<int> sharedSnapshotsGeneration {1};
+
+size_t LabelNameHash::operator()(const string & s) const {
+    size_t h = 5381;
+    for (char c : s) {
+        h = h * 33 + (size_t)tolower((unsigned char)c);
+    }
+    return h;
+}
+
+bool LabelNameEqual::operator()(const string & a, const string & b) const {
+    if (a.length() != b.length()) {
+        return false;
+    }
+    for (size_t ii = 0; ii < a.length(); ii ++) {
+        if (tolower((unsigned char)a[ii]) != tolower((unsigned char)b[ii])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+LabelSnapshot::LabelSnapshot(vector<shared_ptr<Label>> labels, int generation) :
+    _labels(labels),
+    _generation(generation)
+{
+    for (const auto & label : _labels) {
+        // parse the label, assign __cls and fill the lazily cached id, account
+        // and version now - once shared, it must not be modified
+        label->toJSON();
+        label->id();
+        label->accountId();
+        label->version();
+
+        string path = label->path();
+        string role = label->role();
+        _byPath.emplace(path, label);
+        if (role != "") {
+            _byRole.emplace(role, label);
+        }
+
+        // \\Inbox should match INBOX, \\Important should match [Gmail]/Important.
+        // Labels earlier in the list take precedence, as they did with a linear scan.
+        string name = path;
+        transform(name.begin(), name.end(), name.begin(), ::tolower);
+        if (name.substr(0, 8) == "[gmail]/") {
+            name = name.substr(8, name.length() - 8);
+        }
+        _bySystemName.emplace("\\" + name, label);
+
+        // sent => [Gmail]/Sent Mail (sent), draft => [Gmail]/Drafts (drafts)
+        if (role != "") {
+            _bySystemName.emplace("\\" + role, label);
+            if (role.back() == 's') {
+                _bySystemName.emplace("\\" + role.substr(0, role.length() - 1), label);
+            }
+        }
+    }
+}
+
+const vector<shared_ptr<Label>> & LabelSnapshot::labels() const {
+    return _labels;
+}
+
+int LabelSnapshot::generation() const {
+    return _generation;
+}
+
+shared_ptr<Label> LabelSnapshot::labelWithPath(const string & path) const {
+    auto it = _byPath.find(path);
+    return it == _byPath.end() ? nullptr : it->second;
+}
+
+shared_ptr<Label> LabelSnapshot::labelWithRole(const string & role) const {
+    auto it = _byRole.find(role);
+    return it == _byRole.end() ? nullptr : it->second;
+}
+
+shared_ptr<Label> LabelSnapshot::labelForXGMLabelName(const string & mlname) const {
+    auto it = _byPath.find(mlname);
+    if (it != _byPath.end()) {
+        return it->second;
+    }
+    if (mlname.length() > 0 && mlname[0] == '\\') {
+        auto sit = _bySystemName.find(mlname);
+        if (sit != _bySystemName.end()) {
+            return sit->second;
+        }
+    }
+
+    spdlog::get("logger")->warn("Label not found: {}", mlname);
+    return nullptr;
+}
+
+#pragma mark Process-wide Snapshots
+
+shared_ptr<const LabelSnapshot> LabelSnapshot::shared(const string & accountId) {
+    auto all = std::atomic_load(&sharedSnapshots);
+    auto it = all->find(accountId);
+    return it == all->end() ? nullptr : it->second;
+}
+
+int LabelSnapshot::sharedGeneration() {
+    return sharedSnapshotsGeneration;
+}
+
+/*
+ Makes `snapshot` the shared snapshot for the account, unless labels have been
+ changed since it started being built - it may have been loaded from a database
+ snapshot that predates the change.
+ */
+void LabelSnapshot::publish(const string & accountId, shared_ptr<const LabelSnapshot> snapshot) {
+    std::lock_guard<std::mutex> lock(sharedSnapshotsMtx);
+    if (snapshot->generation() != sharedSnapshotsGeneration) {
+        return;
+    }
+    auto next = make_shared<LabelSnapshotMap>(*std::atomic_load(&sharedSnapshots));
+    (*next)[accountId] = snapshot;
+    std::atomic_store(&sharedSnapshots, shared_ptr<const LabelSnapshotMap>(next));
+}
+
+/*
+ Call after changes to labels are committed. Readers holding the old snapshot
+ keep using it, and the next reader loads and publishes a new one.
+ */
+void LabelSnapshot::invalidateShared() {
+    std::lock_guard<std::mutex> lock(sharedSnapshotsMtx);
+    sharedSnapshotsGeneration += 1;
+    std::atomic_store(&sharedSnapshots, shared_ptr<const LabelSnapshotMap>(make_shared<LabelSnapshotMap>()));
+}
@@ -0,0 +1,68 @@
+//
+//  LabelSnapshot.hpp
+//  MailSync
+//
+//  Created by agent on 10/17/26.
+//  Copyright © 2026 Foundry 376. All rights reserved.
+//
+//  Use of this file is subject to the terms and conditions defined
+//  in 'LICENSE.md', which is part of the Mailspring-Sync package.
+//
+
+#ifndef LabelSnapshot_hpp
+#define LabelSnapshot_hpp
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "Label.hpp"
+
+using namespace std;
+
+// Case-insensitive hashing for Gmail system label names ("\\Inbox" vs "\\inbox")
+struct LabelNameHash {
+    size_t operator()(const string & s) const;
+};
+
+struct LabelNameEqual {
+    bool operator()(const string & a, const string & b) const;
+};
+
+/*
+ An immutable set of an account's labels, indexed for resolving X-GM-LABELS
+ values. Snapshots are shared by every worker thread: MailStore publishes one
+ after loading the labels and replaces it (read-copy-update) when labels change,
+ so readers never lock and never copy the label list.
+
+ The Label models in a snapshot must be treated as read-only. They're fully
+ loaded when the snapshot is built (including the JSON and the lazily cached
+ id, account and version), so reading them from any thread is safe.
+ */
+class LabelSnapshot {
+    vector<shared_ptr<Label>> _labels;
+    unordered_map<string, shared_ptr<Label>> _byPath;
+    unordered_map<string, shared_ptr<Label>> _byRole;
+    unordered_map<string, shared_ptr<Label>, LabelNameHash, LabelNameEqual> _bySystemName;
+    int _generation;
+
+public:
+    LabelSnapshot(vector<shared_ptr<Label>> labels, int generation);
+
+    const vector<shared_ptr<Label>> & labels() const;
+    int generation() const;
+
+    shared_ptr<Label> labelWithPath(const string & path) const;
+    shared_ptr<Label> labelWithRole(const string & role) const;
+    shared_ptr<Label> labelForXGMLabelName(const string & mlname) const;
+
+    // Process-wide snapshots
+
+    static shared_ptr<const LabelSnapshot> shared(const string & accountId);
+    static int sharedGeneration();
+    static void publish(const string & accountId, shared_ptr<const LabelSnapshot> snapshot);
+    static void invalidateShared();
+};
+
+#endif /* LabelSnapshot_hpp */
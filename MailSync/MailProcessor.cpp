@@ -21,7 +21,23 @@
 #include <locale>
 #endif
 
+// insertMessages commits after this many messages or this many milliseconds,
+// whichever comes first. The latency cap matters more than the size: the write
+// lock is held for the whole batch and other workers wait behind it.
+#define INSERT_BATCH_SIZE           250
+#define INSERT_BATCH_MAX_MS         150
+
+#define THREAD_CACHE_MESSAGE_IDS    20000
+#define THREAD_CACHE_GMAIL_IDS      5000
+#define THREAD_CACHE_THREADS        2000
+
+// characters of each message body included in the thread's search index, and the
+// number of messages whose flattened text is kept for rebuilding thread rows
+#define THREAD_SEARCH_BODY_LENGTH   5000
+#define THREAD_SEARCH_BODY_CACHE    1000
+
 using namespace std;
+using namespace std::chrono;
 using nlohmann::json;
 
 class CleanHTMLBodyRendererTemplateCallback : public Object, public HTMLRendererTemplateCallback {
@@ -76,11 +92,29 @@ string stringByAppendingOrSkipping(string input, string val) {
 MailProcessor::MailProcessor(shared_ptr<Account> account, MailStore * store) :
     store(store),
     account(account),
-    logger(spdlog::get("logger"))
+    logger(spdlog::get("logger")),
+    insertBatchSize(INSERT_BATCH_SIZE),
+    insertBatchMaxMs(INSERT_BATCH_MAX_MS),
+    threadIdsByHeaderMessageId(THREAD_CACHE_MESSAGE_IDS),
+    threadIdsByGThrId(THREAD_CACHE_GMAIL_IDS),
+    threadsById(THREAD_CACHE_THREADS),
+    threadsByIdRollbacks(store->transactionRollbacks()),
+    threadCacheHits(0),
+    threadCacheMisses(0),
+    searchBodiesByMessageId(THREAD_SEARCH_BODY_CACHE)
 {
 
 }
 
+void MailProcessor::setInsertBatchLimits(int maxMessages, int maxMilliseconds) {
+    insertBatchSize = max(1, maxMessages);
+    insertBatchMaxMs = max(1, maxMilliseconds);
+}
+
+int MailProcessor::insertBatchLimit() {
+    return insertBatchSize;
+}
+
 shared_ptr<Message> MailProcessor::insertFallbackToUpdateMessage(IMAPMessage * mMsg, Folder & folder, time_t syncDataTimestamp) {
     try {
         return insertMessage(mMsg, folder, syncDataTimestamp);
@@ -99,6 +133,157 @@ shared_ptr<Message> MailProcessor::insertFallbackToUpdateMessage(IMAPMessage * m
 }
 
 shared_ptr<Message> MailProcessor::insertMessage(IMAPMessage * mMsg, Folder & folder, time_t syncDataTimestamp) {
+    shared_ptr<Message> msg = nullptr;
+
+    {
+        MailStoreTransaction transaction{store, "insertMessage"};
+        msg = insertMessageWithinTransaction(mMsg, folder, syncDataTimestamp);
+        transaction.commit();
+    }
+
+    {
+        // Index contacts for autocomplete. We do this separately in a transaction that does not
+        // emit any deltas, since the client doesn't need to be bothered with contacts changes.
+        MailStoreTransaction transaction{store, "insertMessage:contacts"};
+        upsertContacts(msg.get());
+        store->unsafeEraseTransactionDeltas();
+        transaction.commit();
+    }
+    return msg;
+}
+
+vector<shared_ptr<Message>> MailProcessor::insertMessages(Array * mMsgs, Folder & folder, time_t syncDataTimestamp) {
+    // Inserts or updates the messages in the order given, committing a batch of them per
+    // transaction rather than paying for a BEGIN / COMMIT (and a WAL commit) for every message.
+    //
+    // Rather than attempting an INSERT and catching the unique constraint failure for
+    // messages we already have (which happens for every message after a UIDVALIDITY reset
+    // or a move between folders), we compute the IDs of each batch and look up the ones
+    // that exist with a single query inside its transaction. The transaction holds the
+    // write lock, so the answer can't change before the batch commits. Existing messages
+    // go straight to the update path.
+    //
+    // If an insert still hits a constraint failure (eg: the same message is listed twice),
+    // the whole batch is rolled back and re-run one message at a time.
+    vector<shared_ptr<Message>> results{};
+    unsigned int count = mMsgs->count();
+    unsigned int ii = 0;
+    auto began = steady_clock::now();
+    auto lastSleep = began;
+
+    int insertedCount = 0;
+    int updatedCount = 0;
+    int fallbackCount = 0;
+    int batchCount = 0;
+
+    while (ii < count) {
+        unsigned int batchStart = ii;
+        vector<shared_ptr<Message>> batch{};
+        vector<shared_ptr<Message>> batchInserted{};
+        bool constraintFailed = false;
+        batchCount += 1;
+
+        {
+            MailStoreTransaction transaction{store, "insertMessages"};
+            auto batchBegan = steady_clock::now();
+
+            try {
+                // Look up which of the batch's messages already exist locally
+                unsigned int batchEnd = min(count, ii + (unsigned int)insertBatchSize);
+                vector<string> ids{};
+                for (unsigned int jj = ii; jj < batchEnd; jj ++) {
+                    IMAPMessage * mMsg = (IMAPMessage *)mMsgs->objectAtIndex(jj);
+                    ids.push_back(MailUtils::idForMessage(folder.accountId(), folder.path(), mMsg));
+                }
+                auto existing = store->findAllMap<Message>(Query().equal("id", ids), "id");
+
+                while (ii < batchEnd) {
+                    IMAPMessage * mMsg = (IMAPMessage *)mMsgs->objectAtIndex(ii);
+                    auto local = existing.find(ids[ii - batchStart]);
+
+                    if (local != existing.end()) {
+                        auto updated = MessageAttributesForMessage(mMsg);
+                        if (messageHasRemoteChanges(local->second.get(), updated, folder, syncDataTimestamp)) {
+                            applyRemoteChanges(local->second.get(), updated, folder, syncDataTimestamp);
+                        }
+                        batch.push_back(local->second);
+                    } else {
+                        auto msg = insertMessageWithinTransaction(mMsg, folder, syncDataTimestamp);
+                        batch.push_back(msg);
+                        batchInserted.push_back(msg);
+                    }
+                    ii ++;
+                    if (duration_cast<milliseconds>(steady_clock::now() - batchBegan).count() > insertBatchMaxMs) {
+                        break;
+                    }
+                }
+                transaction.commit();
+            } catch (const SQLite::Exception & ex) {
+                if (ex.getErrorCode() != 19) { // constraint failed
+                    throw;
+                }
+                constraintFailed = true;
+            }
+        }
+
+        if (constraintFailed) {
+            // The transaction has been rolled back, and the models we loaded or created for
+            // it may have been mutated. Re-run everything up to and including the message that
+            // failed individually, then resume batching after it.
+            logger->info("- Batch insert hit an existing message, retrying {} messages individually", ii - batchStart + 1);
+            batch = {};
+            for (unsigned int jj = batchStart; jj <= ii; jj ++) {
+                IMAPMessage * mMsg = (IMAPMessage *)mMsgs->objectAtIndex(jj);
+                batch.push_back(insertFallbackToUpdateMessage(mMsg, folder, syncDataTimestamp));
+            }
+            fallbackCount += 1;
+            ii ++;
+
+            // the thread cache may point at threads created in the rolled back transaction
+            threadIdsByHeaderMessageId.clear();
+            threadIdsByGThrId.clear();
+            threadsById.clear();
+        } else {
+            insertedCount += batchInserted.size();
+            updatedCount += batch.size() - batchInserted.size();
+
+            // Index contacts for autocomplete for the new messages, without emitting deltas.
+            // See insertMessage.
+            if (batchInserted.size()) {
+                MailStoreTransaction transaction{store, "insertMessages:contacts"};
+                for (auto & msg : batchInserted) {
+                    upsertContacts(msg.get());
+                }
+                store->unsafeEraseTransactionDeltas();
+                transaction.commit();
+            }
+        }
+
+        results.insert(results.end(), batch.begin(), batch.end());
+
+        // Never sit in a hard loop inserting things into the database for more than 250ms.
+        // This ensures we don't starve another thread waiting for a database connection
+        if (duration_cast<milliseconds>(steady_clock::now() - lastSleep).count() > 250) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            lastSleep = steady_clock::now();
+        }
+    }
+
+    long long elapsed = max((long long)1, (long long)duration_cast<milliseconds>(steady_clock::now() - began).count());
+    logger->info("- Ingested {} messages in {}ms ({}/sec): {} new, {} existing, {} of {} batches fell back ({}%)",
+                 count, elapsed, (count * 1000) / elapsed, insertedCount, updatedCount,
+                 fallbackCount, batchCount, (fallbackCount * 100) / max(1, batchCount));
+
+    long long lookups = threadCacheHits + threadCacheMisses;
+    if (lookups > 0) {
+        logger->info("- Thread cache: {} lookups, {}% hit rate, {} message IDs cached",
+                     lookups, (threadCacheHits * 100) / lookups, threadIdsByHeaderMessageId.size());
+    }
+
+    return results;
+}
+
+shared_ptr<Message> MailProcessor::insertMessageWithinTransaction(IMAPMessage * mMsg, Folder & folder, time_t syncDataTimestamp) {
     shared_ptr<Message> msg = make_shared<Message>(mMsg, folder, syncDataTimestamp);
     shared_ptr<Thread> thread = nullptr;
 
@@ -108,75 +293,158 @@ shared_ptr<Message> MailProcessor::insertMessage(IMAPMessage * mMsg, Folder & fo
         references->autorelease();
     }
 
-    {
-        MailStoreTransaction transaction{store, "insertMessage"};
-
-        // Find the correct thread
+    // Find the correct thread. We check the in-memory cache of recently seen
+    // thread IDs first, since the reference lookup is the most expensive part of
+    // ingesting a message on mailing-list-heavy folders.
 
-        if (mMsg->gmailThreadID()) {
-            Query query = Query().equal("gThrId", to_string(mMsg->gmailThreadID()));
+    if (mMsg->gmailThreadID()) {
+        string gThrId = to_string(mMsg->gmailThreadID());
+        thread = threadFromCache(threadIdsByGThrId, gThrId);
+        if (thread != nullptr) {
+            threadCacheHits += 1;
+        } else {
+            threadCacheMisses += 1;
+            Query query = Query().equal("gThrId", gThrId);
             thread = store->find<Thread>(query);
-            
-        } else if (!mMsg->header()->isMessageIDAutoGenerated()) {
-            // find an existing thread using the references. Note - a rouge client could
-            // throw a lot of shit in here, limit the number of refs we look at to 50.
-            // TODO: It appears we should technically use the first 1 and then last 49.
-            int refcount = min(50, (int)references->count());
-            SQLite::Statement tQuery(store->db(), "SELECT Thread.* FROM Thread INNER JOIN ThreadReference ON ThreadReference.threadId = Thread.id WHERE ThreadReference.accountId = ? AND ThreadReference.headerMessageId IN (" + MailUtils::qmarks(1 + refcount) + ") LIMIT 1");
-            tQuery.bind(1, msg->accountId());
-            tQuery.bind(2, msg->headerMessageId());
+        }
+        
+    } else if (!mMsg->header()->isMessageIDAutoGenerated()) {
+        // find an existing thread using the references. Note - a rouge client could
+        // throw a lot of shit in here, limit the number of refs we look at to 50.
+        // TODO: It appears we should technically use the first 1 and then last 49.
+        int refcount = min(50, (int)references->count());
+
+        thread = threadFromCache(threadIdsByHeaderMessageId, msg->headerMessageId());
+        for (int i = 0; thread == nullptr && i < refcount; i ++) {
+            String * ref = (String *)references->objectAtIndex(i);
+            thread = threadFromCache(threadIdsByHeaderMessageId, ref->UTF8Characters());
+        }
+        if (thread != nullptr) {
+            threadCacheHits += 1;
+        } else {
+            threadCacheMisses += 1;
+            auto tQuery = store->cachedStatement("SELECT Thread.id FROM Thread INNER JOIN ThreadReference ON ThreadReference.threadId = Thread.id WHERE ThreadReference.accountId = ? AND ThreadReference.headerMessageId IN (" VALUE_SET_SELECT ") LIMIT 1");
+            ValueSet refs{};
+            refs.add(msg->headerMessageId());
             for (int i = 0; i < refcount; i ++) {
                 String * ref = (String *)references->objectAtIndex(i);
-                tQuery.bind(3 + i, ref->UTF8Characters());
+                refs.add(string(ref->UTF8Characters()));
             }
-            if (tQuery.executeStep()) {
-                thread = make_shared<Thread>(tQuery);
+            tQuery->bind(1, msg->accountId());
+            refs.bind(*tQuery, 2);
+            if (tQuery->executeStep()) {
+                // load through the store so we get the instance awaiting a deferred save, if any
+                string threadId = tQuery->getColumn("id").getString();
+                tQuery->reset();
+                thread = store->find<Thread>(Query().equal("id", threadId));
+            } else {
+                tQuery->reset();
             }
         }
-        
-        if (thread == nullptr) {
-            // TODO: could move to message save hooks
-            thread = make_shared<Thread>(msg->id(), account->id(), msg->subject(), mMsg->gmailThreadID());
-        }
-        
-        msg->setThreadId(thread->id());
+    }
+    
+    if (thread == nullptr) {
+        // TODO: could move to message save hooks
+        thread = make_shared<Thread>(msg->id(), account->id(), msg->subject(), mMsg->gmailThreadID());
+    }
+    
+    msg->setThreadId(thread->id());
 
-        // Index the thread metadata for search. We only do this once and it'd
-        // be costly to make it part of the save hooks.
-        appendToThreadSearchContent(thread.get(), msg.get(), nullptr);
-        store->save(thread.get());
+    // Queue the thread to be indexed for search. This is deferred so ingest doesn't
+    // rewrite the thread's index for every message - see indexQueuedThreads.
+    createThreadSearchRow(thread.get());
+    queueThreadSearchIndex(thread->id());
+    store->save(thread.get());
 
-        // Save the message - this will automatically find and update the counters
-        // on the thread we just created. Kind of a shame to find it twice but oh well.
-        store->save(msg.get());
-        
-        // Make the thread accessible by all of the message references
-        upsertThreadReferences(thread->id(), thread->accountId(), msg->headerMessageId(), references);
+    // Save the message - this will automatically find and update the counters
+    // on the thread we just created. Kind of a shame to find it twice but oh well.
+    store->save(msg.get());
+    
+    // Make the thread accessible by all of the message references
+    upsertThreadReferences(thread->id(), thread->accountId(), msg->headerMessageId(), references);
+    if (mMsg->gmailThreadID()) {
+        threadIdsByGThrId.put(to_string(mMsg->gmailThreadID()), thread->id());
+    }
 
-        transaction.commit();
+    // Saving the message updated the thread through the instance held for the deferred
+    // save. Keep that one, since it's what will be written when the transaction commits.
+    auto deferred = store->findDeferred<Thread>(thread->id());
+    threadsById.put(thread->id(), deferred != nullptr ? deferred : thread);
+
+    return msg;
+}
+
+shared_ptr<Thread> MailProcessor::threadFromCache(LRUCache<string, string> & cache, const string & key) {
+    string * threadId = cache.get(key);
+    if (threadId == nullptr) {
+        return nullptr;
+    }
+
+    // Inside a batch the thread is usually already held for a deferred save, and that
+    // instance is the only correct one to modify.
+    auto thread = store->findDeferred<Thread>(*threadId);
+    if (thread != nullptr) {
+        threadsById.put(thread->id(), thread);
+        return thread;
+    }
+
+    // A rolled back transaction may have modified kept threads without saving them.
+    if (store->transactionRollbacks() != threadsByIdRollbacks) {
+        threadsByIdRollbacks = store->transactionRollbacks();
+        threadsById.clear();
+    }
+
+    // Otherwise reuse the model we kept if the row hasn't been written since. The thread
+    // may have been removed (when its last message was deleted) or saved by another worker,
+    // and comparing the version catches both without parsing the row.
+    auto versionQuery = store->cachedStatement("SELECT version FROM Thread WHERE id = ?");
+    versionQuery->bind(1, *threadId);
+    if (!versionQuery->executeStep()) {
+        versionQuery->reset();
+        threadsById.erase(*threadId);
+        cache.erase(key);
+        return nullptr;
+    }
+    int version = versionQuery->getColumn("version").getInt();
+    versionQuery->reset();
+
+    shared_ptr<Thread> * kept = threadsById.get(*threadId);
+    if (kept != nullptr && (*kept)->version() == version) {
+        return *kept;
+    }
+    thread = store->find<Thread>(Query().equal("id", *threadId));
+    if (thread == nullptr) {
+        threadsById.erase(*threadId);
+        cache.erase(key);
+        return nullptr;
+    }
+    threadsById.put(thread->id(), thread);
+    return thread;
+}
+
+void MailProcessor::updateMessage(Message * local, IMAPMessage * remote, Folder & folder, time_t syncDataTimestamp)
+{
+    auto updated = MessageAttributesForMessage(remote);
+
+    if (!messageHasRemoteChanges(local, updated, folder, syncDataTimestamp)) {
+        return;
     }
 
     {
-        // Index contacts for autocomplete. We do this separately in a transaction that does not
-        // emit any deltas, since the client doesn't need to be bothered with contacts changes.
-        MailStoreTransaction transaction{store, "insertMessage:contacts"};
-        upsertContacts(msg.get());
-        store->unsafeEraseTransactionDeltas();
+        MailStoreTransaction transaction{store, "updateMessage"};
+        applyRemoteChanges(local, updated, folder, syncDataTimestamp);
         transaction.commit();
     }
-    return msg;
 }
 
-void MailProcessor::updateMessage(Message * local, IMAPMessage * remote, Folder & folder, time_t syncDataTimestamp)
+bool MailProcessor::messageHasRemoteChanges(Message * local, MessageAttributes & updated, Folder & folder, time_t syncDataTimestamp)
 {
     if (local->syncedAt() > syncDataTimestamp) {
         logger->warn("Ignoring changes to {}, local data is newer {} < {}", local->subject(), syncDataTimestamp, local->syncedAt());
-        return;
+        return false;
     }
     
-    auto updated = MessageAttributesForMessage(remote);
     auto jlabels = json(updated.labels);
-
     
     bool noChanges = true;
     if (updated.unread != local->isUnread()) {
@@ -210,28 +478,25 @@ void MailProcessor::updateMessage(Message * local, IMAPMessage * remote, Folder
         noChanges = false;
     }
 
-    if (noChanges) {
-        return;
-    }
+    return !noChanges;
+}
 
-    {
-        MailStoreTransaction transaction{store, "updateMessage"};
-    
-        local->setUnread(updated.unread);
-        local->setStarred(updated.starred);
-        local->setDraft(updated.draft);
-        local->setRemoteUID(updated.uid);
-        local->setRemoteFolder(&folder);
-        local->setSyncedAt(syncDataTimestamp);
-        local->setClientFolder(&folder);
-        local->setRemoteXGMLabels(jlabels);
-        
-        // Save the message - this will automatically find and update the counters
-        // on the thread we just created. Kind of a shame to find it twice but oh well.
-        store->save(local);
+void MailProcessor::applyRemoteChanges(Message * local, MessageAttributes & updated, Folder & folder, time_t syncDataTimestamp)
+{
+    auto jlabels = json(updated.labels);
 
-        transaction.commit();
-    }
+    local->setUnread(updated.unread);
+    local->setStarred(updated.starred);
+    local->setDraft(updated.draft);
+    local->setRemoteUID(updated.uid);
+    local->setRemoteFolder(&folder);
+    local->setSyncedAt(syncDataTimestamp);
+    local->setClientFolder(&folder);
+    local->setRemoteXGMLabels(jlabels);
+    
+    // Save the message - this will automatically find and update the counters
+    // on the thread we just created. Kind of a shame to find it twice but oh well.
+    store->save(local);
 }
 
 void MailProcessor::retrievedMessageBody(Message * message, MessageParser * parser) {
@@ -309,8 +574,12 @@ void MailProcessor::retrievedMessageBody(Message * message, MessageParser * pars
         // write body to the MessageBodies table
         SQLite::Statement insert(store->db(), "REPLACE INTO MessageBody (id, value, fetchedAt) VALUES (?, ?, datetime('now'))");
         insert.bind(1, message->id());
-        insert.bind(2, bodyRepresentation);
+        store->bindBody(insert, 2, bodyRepresentation);
         insert.exec();
+
+        SQLite::Statement dequeue(store->db(), "DELETE FROM PendingBody WHERE id = ?");
+        dequeue.bind(1, message->id());
+        dequeue.exec();
         
         // write files to the files table
         
@@ -325,11 +594,9 @@ void MailProcessor::retrievedMessageBody(Message * message, MessageParser * pars
             }
         }
         
-        // append the body text to the thread's FTS5 search index
-        auto thread = store->find<Thread>(Query().equal("id", message->threadId()));
-        if (thread.get() != nullptr) {
-            appendToThreadSearchContent(thread.get(), nullptr, text);
-        }
+        // the thread's search index is rebuilt to include the body later
+        searchBodiesByMessageId.erase(message->id());
+        queueThreadSearchIndex(message->threadId());
 
         // write the message snippet. This also gives us the database trigger!
         message->setSnippet(text->substringToIndex(400)->UTF8Characters());
@@ -358,39 +625,38 @@ bool MailProcessor::retrievedFileData(File * file, Data * data) {
 void MailProcessor::unlinkMessagesMatchingQuery(Query & query, int phase)
 {
     // Note: This method may be called with a Query() returning the entire folder
-    // in case of UIDInvalidity. Loading + saving is super inefficient in this rare case,
-    // but the field is currently both in the JSON and in a separate column. In the future
-    // we may want to make the column the sole source of truth, but it looks like a
-    // complicated change because _data is used for cloning models, etc and inflation
-    // is very abstracted.
+    // in case of UIDInvalidity. Rather than loading and saving every message, we
+    // update the remoteUID column and the copy of it in the model JSON in SQL.
+    // This doesn't emit deltas or bump the message versions, because the client
+    // can't see the remoteUID, the only change that we make here.
     
     logger->info("Unlinking messages {} no longer present in remote range.", query.getSQL());
     
     {
         MailStoreTransaction transaction{store, "unlinkMessagesMatchingQuery"};
 
-        auto deletedMsgs = store->findAll<Message>(query);
-        bool logSubjects = deletedMsgs.size() < 20;
+        // messages we unlinked in a previous cycle will be deleted momentarily - leave them be.
+        string where = query.getSQL();
+        where += (where.length() ? " AND " : " WHERE ") + string("remoteUID <= ") + to_string(LOCAL_FOLDER_UID_MAX);
 
-        logger->info("-- {} matches.", deletedMsgs.size());
+        // the models aren't saved, so collect the UIDs to remove from the cached folder UIDs
+        map<string, vector<uint32_t>> unlinkedUIDs{};
+        SQLite::Statement select(store->db(), "SELECT remoteFolderId, remoteUID FROM Message" + where);
+        query.bind(select);
+        while (select.executeStep()) {
+            unlinkedUIDs[select.getColumn(0).getString()].push_back((uint32_t)select.getColumn(1).getInt64());
+        }
 
-        for (const auto msg : deletedMsgs) {
-            if (msg->remoteUID() > UINT32_MAX - 5) {
-                // we unlinked this message in a previous cycle and it will be deleted momentarily.
-                continue;
-            }
-            
-            // don't spam the logs when a zillion messages are being deleted
-            if (logSubjects) {
-                logger->info("-- Unlinking \"{}\" ({})", msg->subject(), msg->id());
-            }
-            msg->setRemoteUID(UINT32_MAX - phase);
-            store->save(msg.get());
+        string unlinkedUID = to_string(UINT32_MAX - phase);
+        SQLite::Statement update(store->db(), "UPDATE Message SET remoteUID = " + unlinkedUID + ", data = mailsync_json_set_key(data, 'remoteUID', " + unlinkedUID + ")" + where);
+        query.bind(update);
+        int unlinked = update.exec();
+
+        for (auto & pair : unlinkedUIDs) {
+            store->didUnlinkMessageUIDs(pair.first, pair.second);
         }
 
-        // we know we don't need to emit this change because the client can't see the remoteUID,
-        // the only change that we make here.
-        store->unsafeEraseTransactionDeltas();
+        logger->info("-- {} unlinked.", unlinked);
         transaction.commit();
     }
 }
@@ -398,21 +664,17 @@ void MailProcessor::unlinkMessagesMatchingQuery(Query & query, int phase)
 void MailProcessor::deleteMessagesStillUnlinkedFromPhase(int phase)
 {
     bool more = true;
-    int chunkSize = 100;
-    int iterations = 0;
+    int chunkSize = 500;
+    int removed = 0;
+    auto began = steady_clock::now();
     
-    // If the user deletes (and we unlink) a zillion messages, we:
-    //
-    // - Delete 100 per transaction to avoid creating a very long-running transaction
-    //
-    // - Bail after 10 iterations. There's really no harm in deleting messages slowly
-    //   since we've unlinked them and they're not visible in the client. We might
-    //   even discover we want them again after all in a large new folder we're pulling
-    //   down in chunks.
+    // If the user deletes (and we unlink) a zillion messages, we delete them in chunks
+    // so no single transaction runs for very long. Each chunk is removed with a handful
+    // of set-based statements, and each affected thread is updated once per chunk
+    // (see MailStore::removeAll), so even a whole-folder reset completes quickly.
 
-    while (more && iterations < 10) {
+    while (more) {
         MailStoreTransaction transaction{store, "deleteMessagesStillUnlinked"};
-        iterations ++;
 
         auto q = Query().equal("accountId", account->id()).equal("remoteUID", UINT32_MAX - phase).limit(chunkSize);
         auto messages = store->findAll<Message>(q);
@@ -423,76 +685,163 @@ void MailProcessor::deleteMessagesStillUnlinkedFromPhase(int phase)
         if (messages.size()) {
             logger->info("-- Removing {} unlinked messages", messages.size());
         }
-        for (auto const & msg : messages) {
-            if (iterations == 1 && !more) { // only log subjects if <100 total
+        if (removed == 0 && !more) { // only log subjects if <500 total
+            for (auto const & msg : messages) {
                 logger->info("-- Removing \"{}\" ({})", msg->subject(), msg->id());
             }
-            store->remove(msg.get());
         }
+        store->removeAll(messages);
+        removed += messages.size();
         
         // send the deltas
         transaction.commit();
+
+        if (more) {
+            // don't starve other threads waiting for the database
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    if (removed > 0) {
+        logger->info("-- Removed {} unlinked messages in {}ms", removed, duration_cast<milliseconds>(steady_clock::now() - began).count());
     }
 }
 
-void MailProcessor::appendToThreadSearchContent(Thread * thread, Message * messageToAppendOrNull, String * bodyToAppendOrNull) {
+/*
+ Inserts a search index row for a new thread so it can be found by subject right
+ away. The rest of the row is filled in by indexThreadSearchContent.
+ */
+void MailProcessor::createThreadSearchRow(Thread * thread) {
+    if (thread->searchRowId()) {
+        return;
+    }
+    ThreadSearchRow row {thread->id(), thread->subject(), "", "", thread->categoriesSearchString(), ""};
+    thread->setSearchRowId(store->insertThreadSearch(row));
+}
+
+void MailProcessor::queueThreadSearchIndex(const string & threadId) {
+    // keeps the original queuedAt if the thread is already queued
+    auto queue = store->cachedStatement("INSERT OR IGNORE INTO ThreadSearchQueue (threadId, accountId, queuedAt) VALUES (?, ?, ?)");
+    queue->bind(1, threadId);
+    queue->bind(2, account->id());
+    queue->bind(3, (long long)time(0));
+    queue->exec();
+}
+
+/*
+ Rebuilds the search index of up to `maxThreads` threads queued at or before
+ `queuedBefore`, oldest first, in one transaction. Returns the number of threads
+ indexed. Each thread's row is built from all of its messages at once, so a long
+ thread costs the same no matter how many times it was queued.
+ */
+int MailProcessor::indexQueuedThreads(int maxThreads, time_t queuedBefore) {
+    MailStoreTransaction transaction{store, "indexQueuedThreads"};
+
+    vector<string> threadIds{};
+    auto next = store->cachedStatement("SELECT threadId FROM ThreadSearchQueue WHERE accountId = ? AND queuedAt <= ? ORDER BY queuedAt LIMIT ?");
+    next->bind(1, account->id());
+    next->bind(2, (long long)queuedBefore);
+    next->bind(3, maxThreads);
+    while (next->executeStep()) {
+        threadIds.push_back(next->getColumn(0).getString());
+    }
+    next->reset();
+
+    if (threadIds.empty()) {
+        return 0;
+    }
+
+    for (auto & thread : store->findLargeSet<Thread>("id", threadIds)) {
+        indexThreadSearchContent(thread.get());
+    }
+
+    auto dequeue = store->cachedStatement("DELETE FROM ThreadSearchQueue WHERE threadId IN (" VALUE_SET_SELECT ")");
+    ValueSet(threadIds).bind(*dequeue, 1);
+    dequeue->exec();
+
+    transaction.commit();
+    return (int)threadIds.size();
+}
+
+void MailProcessor::indexThreadSearchContent(Thread * thread) {
+    AutoreleasePool pool;
+
     string to = "";
     string from = "";
-    string categories = thread->categoriesSearchString();
     string body = "";
-    
-    // retrieve the current index if there is one
-    if (thread->searchRowId()) {
-        SQLite::Statement existing(store->db(), "SELECT to_, from_, body FROM ThreadSearch WHERE rowid = ?");
-        existing.bind(1, (double)thread->searchRowId());
-        if (existing.executeStep()) {
-            to = existing.getColumn("to_").getString();
-            from = existing.getColumn("from_").getString();
-            body = existing.getColumn("body").getString();
-        }
-    }
-    
-    if (messageToAppendOrNull != nullptr) {
-        for (auto c : messageToAppendOrNull->to()) {
+
+    auto messages = store->findAll<Message>(Query().equal("threadId", thread->id()));
+    sort(messages.begin(), messages.end(), [](const shared_ptr<Message> & a, const shared_ptr<Message> & b) {
+        return a->date() < b->date();
+    });
+
+    vector<string> messageIds{};
+    for (auto & message : messages) {
+        messageIds.push_back(message->id());
+        for (auto c : message->to()) {
             if (c.count("email")) { to = stringByAppendingOrSkipping(to, c["email"].get<string>()); }
             if (c.count("name")) { to = stringByAppendingOrSkipping(to, c["name"].get<string>()); }
         }
-        for (auto c : messageToAppendOrNull->cc()) {
+        for (auto c : message->cc()) {
             if (c.count("email")) { to = stringByAppendingOrSkipping(to, c["email"].get<string>()); }
             if (c.count("name")) { to = stringByAppendingOrSkipping(to, c["name"].get<string>()); }
         }
-        for (auto c : messageToAppendOrNull->bcc()) {
+        for (auto c : message->bcc()) {
             if (c.count("email")) { to = stringByAppendingOrSkipping(to, c["email"].get<string>()); }
             if (c.count("name")) { to = stringByAppendingOrSkipping(to, c["name"].get<string>()); }
         }
-        for (auto c : messageToAppendOrNull->from()) {
+        for (auto c : message->from()) {
             if (c.count("email")) { from = stringByAppendingOrSkipping(from, c["email"].get<string>()); }
             if (c.count("name")) { from = stringByAppendingOrSkipping(from, c["name"].get<string>()); }
         }
     }
-    
-    if (bodyToAppendOrNull != nullptr) {
-        body = body + " " + bodyToAppendOrNull->substringToIndex(5000)->UTF8Characters();
+
+    // Threads are re-indexed each time a message or body arrives, so the flattened
+    // text of each body is cached and only new bodies are loaded and flattened.
+    map<string, string> texts{};
+    vector<string> uncachedIds{};
+    for (auto & message : messages) {
+        string * cached = searchBodiesByMessageId.get(message->id());
+        if (cached != nullptr) {
+            texts[message->id()] = *cached;
+        } else {
+            uncachedIds.push_back(message->id());
+        }
     }
-    
-    if (thread->searchRowId()) {
-        SQLite::Statement update(store->db(), "UPDATE ThreadSearch SET to_ = ?, from_ = ?, body = ?, categories = ? WHERE rowid = ?");
-        update.bind(1, to);
-        update.bind(2, from);
-        update.bind(3, body);
-        update.bind(4, categories);
-        update.bind(5, (double)thread->searchRowId());
-        update.exec();
+    if (uncachedIds.size()) {
+        map<string, shared_ptr<Message>> byId{};
+        for (auto & message : messages) {
+            byId[message->id()] = message;
+        }
+        auto bodiesQuery = store->cachedStatement("SELECT id, mailsync_body(value) FROM MessageBody WHERE value IS NOT NULL AND id IN (" VALUE_SET_SELECT ")");
+        ValueSet(uncachedIds).bind(*bodiesQuery, 1);
+        while (bodiesQuery->executeStep()) {
+            string id = bodiesQuery->getColumn(0).getString();
+            String * text = String::stringWithUTF8Characters(bodiesQuery->getColumn(1).getText());
+            if (!byId[id]->plaintext()) {
+                text = text->flattenHTML()->stripWhitespace();
+            }
+            texts[id] = text->substringToIndex(THREAD_SEARCH_BODY_LENGTH)->UTF8Characters();
+            searchBodiesByMessageId.put(id, texts[id]);
+        }
+        bodiesQuery->reset();
+    }
+
+    for (auto & message : messages) {
+        auto it = texts.find(message->id());
+        if (it == texts.end()) {
+            continue;
+        }
+        body = body + " " + it->second;
+    }
+
+    ThreadSearchRow row {thread->id(), thread->subject(), to, from, thread->categoriesSearchString(), body};
+    ThreadSearchRow indexed;
+    if (thread->searchRowId() && store->loadThreadSearch(thread->searchRowId(), indexed)) {
+        store->updateThreadSearch(thread->searchRowId(), indexed, row);
     } else {
-        SQLite::Statement insert(store->db(), "INSERT INTO ThreadSearch (subject, to_, from_, body, categories, content_id) VALUES (?, ?, ?, ?, ?, ?)");
-        insert.bind(1, thread->subject());
-        insert.bind(2, to);
-        insert.bind(3, from);
-        insert.bind(4, body);
-        insert.bind(5, categories);
-        insert.bind(6, thread->id());
-        insert.exec();
-        thread->setSearchRowId(store->db().getLastInsertRowid());
+        thread->setSearchRowId(store->insertThreadSearch(row));
+        store->save(thread);
     }
 }
 
@@ -501,7 +850,10 @@ void MailProcessor::upsertThreadReferences(string threadId, string accountId, st
     query.bind(1, threadId);
     query.bind(2, accountId);
     query.bind(3, headerMessageId);
-    query.exec();
+    // an existing reference keeps its thread, so only cache the ones we inserted
+    if (query.exec() == 1) {
+        threadIdsByHeaderMessageId.put(headerMessageId, threadId);
+    }
     query.reset();
 
     // todo: technically, we should look at the first reference (Start of thread)
@@ -510,7 +862,9 @@ void MailProcessor::upsertThreadReferences(string threadId, string accountId, st
     for (int i = 0; i < min(100, (int)references->count()); i ++) {
         String * address = (String*)references->objectAtIndex(i);
         query.bind(3, address->UTF8Characters());
-        query.exec();
+        if (query.exec() == 1) {
+            threadIdsByHeaderMessageId.put(address->UTF8Characters(), threadId);
+        }
         query.reset(); // does not clear bindings 1 and 2! https://sqlite.org/c3ref/reset.html
     }
 }
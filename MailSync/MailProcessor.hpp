@@ -27,27 +27,59 @@
 #include "Account.hpp"
 
 #include "MailStore.hpp"
+#include "LRUCache.hpp"
 
 using namespace mailcore;
 using namespace std;
 
+// Threads queued for search indexing are rebuilt in batches of this size. When the
+// background worker isn't idle, only threads queued longer than THREAD_SEARCH_MAX_DELAY
+// seconds ago are indexed.
+#define THREAD_SEARCH_INDEX_BATCH   50
+#define THREAD_SEARCH_MAX_DELAY     (5 * 60)
+
 class MailProcessor {
     MailStore * store;
     shared_ptr<Account> account;
     shared_ptr<spdlog::logger> logger;
 
+    int insertBatchSize;
+    int insertBatchMaxMs;
+
+    // Recently seen Message-IDs / Gmail thread IDs and the threads they belong to.
+    // Entries are hints - the thread's row version is checked before use.
+    LRUCache<string, string> threadIdsByHeaderMessageId;
+    LRUCache<string, string> threadIdsByGThrId;
+    LRUCache<string, shared_ptr<Thread>> threadsById;
+    unsigned long threadsByIdRollbacks;
+    long long threadCacheHits;
+    long long threadCacheMisses;
+
+    // The flattened, truncated body text of recently indexed messages. See indexThreadSearchContent.
+    LRUCache<string, string> searchBodiesByMessageId;
+
 public:
     MailProcessor(shared_ptr<Account> account, MailStore * store);
     shared_ptr<Message> insertFallbackToUpdateMessage(IMAPMessage * mMsg, Folder & folder, time_t syncDataTimestamp);
     shared_ptr<Message> insertMessage(IMAPMessage * mMsg, Folder & folder, time_t syncDataTimestamp);
+    vector<shared_ptr<Message>> insertMessages(Array * mMsgs, Folder & folder, time_t syncDataTimestamp);
+    void setInsertBatchLimits(int maxMessages, int maxMilliseconds);
+    int insertBatchLimit();
     void updateMessage(Message * local, IMAPMessage * remote, Folder & folder, time_t syncDataTimestamp);
     void retrievedMessageBody(Message * message, MessageParser * parser);
     bool retrievedFileData(File * file, Data * data);
     void unlinkMessagesMatchingQuery(Query & query, int phase);
     void deleteMessagesStillUnlinkedFromPhase(int phase);
+    int indexQueuedThreads(int maxThreads, time_t queuedBefore);
     
 private:
-    void appendToThreadSearchContent(Thread * thread, Message * messageToAppendOrNull, String * bodyToAppendOrNull);
+    shared_ptr<Message> insertMessageWithinTransaction(IMAPMessage * mMsg, Folder & folder, time_t syncDataTimestamp);
+    shared_ptr<Thread> threadFromCache(LRUCache<string, string> & cache, const string & key);
+    bool messageHasRemoteChanges(Message * local, MessageAttributes & updated, Folder & folder, time_t syncDataTimestamp);
+    void applyRemoteChanges(Message * local, MessageAttributes & updated, Folder & folder, time_t syncDataTimestamp);
+    void createThreadSearchRow(Thread * thread);
+    void queueThreadSearchIndex(const string & threadId);
+    void indexThreadSearchContent(Thread * thread);
     void upsertThreadReferences(string threadId, string accountId, string headerMessageId, Array * references);
     void upsertContacts(Message * message);
     shared_ptr<Label> labelForXGMLabelName(string mlname);
@@ -9,9 +9,23 @@
 //  in 'LICENSE.md', which is part of the Mailspring-Sync package.
 //
 
+#include <sqlite3.h>
+#include <mutex>
+#include <thread>
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+#include <codecvt>
+#include <locale>
+#else
+#include <unistd.h>
+#endif
+
 #include "MailStore.hpp"
 #include "MailUtils.hpp"
 #include "MailStoreTransaction.hpp"
+#include "BodyCodec.hpp"
+#include "MemoryBudget.hpp"
 #include "SyncException.hpp"
 #include "constants.h"
 
@@ -22,8 +36,6 @@
 using namespace mailcore;
 using namespace std;
 
-std::atomic<int> globalLabelsVersion {1};
-
 #pragma mark Metadata
 
 Metadata MetadataFromJSON(const json & metadata) {
@@ -72,22 +84,412 @@ MessageAttributes MessageAttributesForMessage(IMAPMessage * msg) {
 }
 
 bool MessageAttributesMatch(MessageAttributes a, MessageAttributes b) {
-    return a.unread == b.unread && a.starred == b.starred && a.uid == b.uid && a.labels == b.labels;
+    return a.unread == b.unread && a.starred == b.starred && a.uid == b.uid && a.labelIds == b.labelIds;
+}
+
+#pragma mark LocalFolderUIDs
+
+void LocalFolderUIDs::add(uint32_t uid, bool isUnread, bool isStarred, const vector<uint32_t> & labelIds) {
+    remove(uid);
+    uids.add(uid);
+    if (isUnread) {
+        unread.add(uid);
+    }
+    if (isStarred) {
+        starred.add(uid);
+    }
+    byLabelIds[labelIds].add(uid);
+}
+
+void LocalFolderUIDs::remove(uint32_t uid) {
+    if (!uids.contains(uid)) {
+        return;
+    }
+    uids.remove(uid);
+    unread.remove(uid);
+    starred.remove(uid);
+    for (auto it = byLabelIds.begin(); it != byLabelIds.end(); it++) {
+        if (it->second.contains(uid)) {
+            it->second.remove(uid);
+            if (it->second.empty()) {
+                byLabelIds.erase(it);
+            }
+            break;
+        }
+    }
+}
+
+bool LocalFolderUIDs::matches(const MessageAttributes & attrs) const {
+    if (!uids.contains(attrs.uid)) {
+        return false;
+    }
+    if (unread.contains(attrs.uid) != attrs.unread || starred.contains(attrs.uid) != attrs.starred) {
+        return false;
+    }
+    auto it = byLabelIds.find(attrs.labelIds);
+    return it != byLabelIds.end() && it->second.contains(attrs.uid);
+}
+
+// Shared by all MailStores. Generations are bumped whenever a folder's committed UIDs
+// change so a copy loaded from the database concurrently with a commit isn't cached.
+static map<string, shared_ptr<LocalFolderUIDs>> sharedFolderUIDs;
+static map<string, int> sharedFolderUIDsGenerations;
+static std::mutex sharedFolderUIDsMtx;
+
+// Call with sharedFolderUIDsMtx held
+static void applySharedFolderUIDsChange(const LocalFolderUIDsChange & change) {
+    sharedFolderUIDsGenerations[change.folderId] += 1;
+    auto it = sharedFolderUIDs.find(change.folderId);
+    if (it == sharedFolderUIDs.end()) {
+        return;
+    }
+    // a worker is still reading this copy, so replace it. Other threads only take
+    // references while holding the lock, so a count of 1 means no one else has it.
+    if (it->second.use_count() > 1) {
+        it->second = make_shared<LocalFolderUIDs>(*it->second);
+    }
+    if (change.add) {
+        it->second->add(change.uid, change.unread, change.starred, change.labelIds);
+    } else {
+        it->second->remove(change.uid);
+    }
+}
+
+#pragma mark Label IDs
+
+/*
+ Message.remoteXGMLabelIds holds the sorted LabelDictionary indexes of the
+ message's labels as little-endian uint32s, so labels can be compared without
+ parsing the remoteXGMLabels JSON or allocating strings.
+ */
+static string packLabelIds(const vector<uint32_t> & ids) {
+    string packed(ids.size() * 4, '\0');
+    for (size_t ii = 0; ii < ids.size(); ii ++) {
+        packed[ii * 4 + 0] = (char)(ids[ii] & 0xFF);
+        packed[ii * 4 + 1] = (char)((ids[ii] >> 8) & 0xFF);
+        packed[ii * 4 + 2] = (char)((ids[ii] >> 16) & 0xFF);
+        packed[ii * 4 + 3] = (char)((ids[ii] >> 24) & 0xFF);
+    }
+    return packed;
+}
+
+static vector<uint32_t> unpackLabelIds(const void * blob, int length) {
+    const uint8_t * bytes = (const uint8_t *)blob;
+    vector<uint32_t> ids{};
+    ids.reserve(length / 4);
+    for (int ii = 0; ii + 3 < length; ii += 4) {
+        ids.push_back(bytes[ii] | (bytes[ii + 1] << 8) | (bytes[ii + 2] << 16) | ((uint32_t)bytes[ii + 3] << 24));
+    }
+    return ids;
+}
+
+
+#pragma mark SQL Functions
+
+/*
+ The `data` column holds JSON text or, for tables that opt in to binary data
+ encoding, CBOR. These helpers read either and write back the same storage class.
+ */
+static json sqliteValueToJSON(sqlite3_value * value) {
+    if (sqlite3_value_type(value) == SQLITE_BLOB) {
+        const uint8_t * bytes = (const uint8_t *)sqlite3_value_blob(value);
+        int length = sqlite3_value_bytes(value);
+        return json::from_cbor(vector<uint8_t>(bytes, bytes + length));
+    }
+    return json::parse((const char *)sqlite3_value_text(value));
+}
+
+static void sqliteResultJSON(sqlite3_context * context, const json & data, bool binary) {
+    if (binary) {
+        vector<uint8_t> bytes = json::to_cbor(data);
+        sqlite3_result_blob(context, bytes.data(), (int)bytes.size(), SQLITE_TRANSIENT);
+    } else {
+        string text = data.dump();
+        sqlite3_result_text(context, text.c_str(), (int)text.length(), SQLITE_TRANSIENT);
+    }
+}
+
+/*
+ mailsync_json_set_key(data, key, value) returns the JSON object `data` with
+ `key` set to `value`. This allows set-based UPDATEs to keep a value that is
+ stored in both a column and the model JSON in sync without inflating the
+ models. (The JSON1 extension is not enabled in our SQLite build.)
+ */
+static void sqliteJSONSetKey(sqlite3_context * context, int argc, sqlite3_value ** argv) {
+    const char * key = (const char *)sqlite3_value_text(argv[1]);
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL || key == nullptr) {
+        sqlite3_result_value(context, argv[0]);
+        return;
+    }
+    try {
+        json data = sqliteValueToJSON(argv[0]);
+        switch (sqlite3_value_type(argv[2])) {
+            case SQLITE_INTEGER:
+                data[key] = sqlite3_value_int64(argv[2]);
+                break;
+            case SQLITE_FLOAT:
+                data[key] = sqlite3_value_double(argv[2]);
+                break;
+            case SQLITE_NULL:
+                data[key] = nullptr;
+                break;
+            default:
+                data[key] = string((const char *)sqlite3_value_text(argv[2]));
+                break;
+        }
+        sqliteResultJSON(context, data, sqlite3_value_type(argv[0]) == SQLITE_BLOB);
+    } catch (std::exception & ex) {
+        sqlite3_result_error(context, ex.what(), -1);
+    }
+}
+
+/*
+ mailsync_data_json(data) converts a `data` value stored as CBOR to JSON text,
+ passing through values that are already text. See MailStore::migrateDataToJSON.
+ */
+static void sqliteDataJSON(sqlite3_context * context, int argc, sqlite3_value ** argv) {
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        sqlite3_result_value(context, argv[0]);
+        return;
+    }
+    try {
+        sqliteResultJSON(context, sqliteValueToJSON(argv[0]), false);
+    } catch (std::exception & ex) {
+        sqlite3_result_error(context, ex.what(), -1);
+    }
+}
+
+/*
+ mailsync_body(value) returns a MessageBody value as text, decompressing values
+ stored by BodyCodec. mailsync_body_compress(value) does the reverse. Readers
+ that expect text can select mailsync_body(value) instead of value.
+ */
+static void sqliteBody(sqlite3_context * context, int argc, sqlite3_value ** argv) {
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        sqlite3_result_value(context, argv[0]);
+        return;
+    }
+    try {
+        string body = BodyCodec::decompress(sqlite3_value_blob(argv[0]), sqlite3_value_bytes(argv[0]));
+        sqlite3_result_text(context, body.c_str(), (int)body.length(), SQLITE_TRANSIENT);
+    } catch (std::exception & ex) {
+        sqlite3_result_error(context, ex.what(), -1);
+    }
+}
+
+static void sqliteBodyCompress(sqlite3_context * context, int argc, sqlite3_value ** argv) {
+    if (sqlite3_value_type(argv[0]) != SQLITE_TEXT) {
+        sqlite3_result_value(context, argv[0]);
+        return;
+    }
+    try {
+        string body((const char *)sqlite3_value_text(argv[0]), sqlite3_value_bytes(argv[0]));
+        vector<uint8_t> bytes = BodyCodec::compress(body);
+        sqlite3_result_blob(context, bytes.data(), (int)bytes.size(), SQLITE_TRANSIENT);
+    } catch (std::exception & ex) {
+        sqlite3_result_error(context, ex.what(), -1);
+    }
+}
+
+static int sqliteWALHook(void * context, sqlite3 * db, const char * dbName, int pages) {
+    ((MailStore *)context)->didCommitToWAL(pages);
+    return SQLITE_OK;
+}
+
+#pragma mark Account Databases
+
+static bool fileExists(string path) {
+#if defined(_WIN32)
+    wstring_convert<codecvt_utf8<wchar_t>, wchar_t> convert;
+    struct _stat buffer;
+    return _wstat(convert.from_bytes(path).c_str(), &buffer) == 0;
+#else
+    struct stat buffer;
+    return stat(path.c_str(), &buffer) == 0;
+#endif
 }
 
+static void removeFile(string path) {
+#if defined(_WIN32)
+    wstring_convert<codecvt_utf8<wchar_t>, wchar_t> convert;
+    _wunlink(convert.from_bytes(path).c_str());
+#else
+    unlink(path.c_str());
+#endif
+}
+
+static void removeAccountDatabaseFile(string path) {
+    removeFile(path + "-wal");
+    removeFile(path + "-shm");
+    removeFile(path);
+}
+
+static bool renameFile(string from, string to) {
+#if defined(_WIN32)
+    wstring_convert<codecvt_utf8<wchar_t>, wchar_t> convert;
+    return _wrename(convert.from_bytes(from).c_str(), convert.from_bytes(to).c_str()) == 0;
+#else
+    return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+// Returns the quoted column names of `table`, for copying rows between databases
+// whose columns may not be in the same order.
+static string columnsOfTable(SQLite::Database & db, string schema, string table) {
+    string columns = "";
+    SQLite::Statement info(db, "PRAGMA " + schema + ".table_info(`" + table + "`)");
+    while (info.executeStep()) {
+        columns += (columns == "" ? "`" : ", `") + info.getColumn("name").getString() + "`";
+    }
+    return columns;
+}
+
+string MailStore::accountDatabaseId = "";
+
+string MailStore::databasePath() {
+    if (accountDatabaseId != "") {
+        return databasePathForAccount(accountDatabaseId);
+    }
+    return MailUtils::getEnvUTF8("CONFIG_DIR_PATH") + FS_PATH_SEP + "edgehill.db";
+}
+
+string MailStore::databasePathForAccount(string accountId) {
+    return MailUtils::getEnvUTF8("CONFIG_DIR_PATH") + FS_PATH_SEP + "edgehill-" + accountId + ".db";
+}
+
+bool MailStore::accountDatabaseExists(string accountId) {
+    return fileExists(databasePathForAccount(accountId));
+}
+
+/*
+ Resets an account that has its own database file by deleting the file. Readers
+ that have it attached must detach it (on Windows, before it can be deleted).
+ */
+void MailStore::removeAccountDatabase(string accountId) {
+    removeAccountDatabaseFile(databasePathForAccount(accountId));
+}
+
+// The _State keys listing the accounts moved to their own database files, and the SQL
+// a connection on the shared database runs to read them - see accountDatabasesSQL.
+static string ACCOUNT_DATABASES_KEY = "ACCOUNT_DATABASES";
+static string ACCOUNT_DATABASES_SQL_KEY = "ACCOUNT_DATABASES_SQL";
+
+/*
+ Returns the statements that attach the given accounts' database files to a connection
+ on the shared database, and create TEMP views combining each table in ACCOUNT_VIEW_TABLES
+ across the shared database and the attached files. TEMP views take precedence over tables
+ of the same name, so unqualified cross-account reads keep working on that connection.
+ The views are read-only, and the FTS tables must be queried in each database separately.
+ */
+string MailStore::accountDatabasesSQL(SQLite::Database & db, vector<string> accountIds) {
+    string sql = "";
+    vector<string> schemas {"main"};
+    for (string accountId : accountIds) {
+        string path = databasePathForAccount(accountId);
+        size_t quote = 0;
+        while ((quote = path.find('\'', quote)) != string::npos) {
+            path.insert(quote, "'");
+            quote += 2;
+        }
+        string schema = "account_" + to_string(schemas.size());
+        sql += "ATTACH DATABASE '" + path + "' AS " + schema + ";\n";
+        schemas.push_back(schema);
+    }
+
+    for (string table : ACCOUNT_VIEW_TABLES) {
+        string columns = columnsOfTable(db, "main", table);
+        string select = "";
+        for (string schema : schemas) {
+            select += string(select == "" ? "" : " UNION ALL ") + "SELECT " + columns + " FROM " + schema + ".`" + table + "`";
+        }
+        sql += "DROP VIEW IF EXISTS temp.`" + table + "`;\n";
+        sql += "CREATE TEMP VIEW `" + table + "` AS " + select + ";\n";
+    }
+    return sql;
+}
 
 #pragma mark MailStore
 
-MailStore::MailStore() :
-    _db(MailUtils::getEnvUTF8("CONFIG_DIR_PATH") + FS_PATH_SEP + "edgehill.db", SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE),
+// The _State key and value recording how the `data` column is encoded, and the
+// tables an earlier build could store as CBOR - see migrateDataToJSON.
+static string DATA_ENCODING_KEY = "DATA_ENCODING";
+static string DATA_ENCODING_JSON = "json";
+static vector<string> DATA_ENCODING_TABLES = {"Message", "Thread"};
+
+// The _State key and values recording how new MessageBody values are stored.
+static string BODY_ENCODING_KEY = "BODY_ENCODING";
+static string BODY_ENCODING_TEXT = "text";
+static string BODY_ENCODING_COMPRESSED = "compressed";
+
+// Clients that read compressed bodies from the database find the preset dictionary
+// for each codec tag here. See BodyCodec.hpp for the format.
+static string BODY_CODEC_DICTIONARY_TABLE = "BodyCodecDictionary";
+
+bool MailStore::compressedBodies() {
+    return _compressedBodies;
+}
+
+void MailStore::bindBody(SQLite::Statement & query, int index, const string & body) {
+    if (_compressedBodies) {
+        vector<uint8_t> bytes = BodyCodec::compress(body);
+        query.bind(index, bytes.data(), (int)bytes.size());
+    } else {
+        query.bind(index, body);
+    }
+}
+
+#define BUSY_TIMEOUT_MS (10 * 1000)
+
+// WAL checkpoint policy, in 4KB pages. A PASSIVE checkpoint (which never waits) runs
+// after any commit that leaves more than WAL_PASSIVE_PAGES in the WAL, as SQLite's
+// autocheckpoint would. Past WAL_TRUNCATE_PAGES, readers are keeping the WAL from
+// being reset, so we wait briefly for them and truncate it. If they're still there,
+// commits go back to PASSIVE checkpoints until the WAL has grown another
+// WAL_TRUNCATE_RETRY_PAGES or WAL_TRUNCATE_RETRY_SECONDS have passed. When the worker
+// is idle we checkpoint and RESTART the WAL, but only if there are no readers to wait for.
+static int WAL_PASSIVE_PAGES = 1000;
+static int WAL_TRUNCATE_PAGES = 16384; // 64MB
+static int WAL_TRUNCATE_BUSY_TIMEOUT_MS = 250;
+static int WAL_TRUNCATE_RETRY_PAGES = 4096; // 16MB
+static int WAL_TRUNCATE_RETRY_SECONDS = 10;
+
+// Number of distinct SELECT statements kept prepared for the find* templates.
+// Most callers use a small, fixed set of query shapes (IN clauses bind their
+// whole set as one parameter), but the cache is bounded in case they don't.
+#define FIND_QUERY_CACHE_SIZE 64
+
+// One in this many saves is timed for the write rate in logStats.
+#define ROW_WRITE_SAMPLE_INTERVAL 64
+
+MailStore::MailStore() : MailStore(MailStore::databasePath()) {
+}
+
+MailStore::MailStore(string path) :
+    _db(path, SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE),
     _stmtBeginTransaction(_db, "BEGIN IMMEDIATE TRANSACTION"),
     _stmtRollbackTransaction(_db, "ROLLBACK"),
     _stmtCommitTransaction(_db, "COMMIT"),
+    _transactionOpen(false),
+    _transactionRollbacks(0),
+    _findQueries(FIND_QUERY_CACHE_SIZE),
+    _findQueriesPrepared(0),
+    _findQueriesReused(0),
+    _findQueriesNested(0),
+    _savesSkipped(0),
+    _savesDataOnly(0),
+    _memoryBudgetGeneration(0),
+    _walPages(0),
+    _walPagesMax(0),
+    _checkpointBusy(0),
+    _checkpointMs(0),
+    _checkpointMsMax(0),
+    _truncateRetryPages(0),
     _owningThread(spdlog::details::os::thread_id()),
-    _labelCacheVersion(0),
-    _labelCache()
+    _labelsChanged(false),
+    _privateLabelSnapshot(nullptr),
+    _compressedBodies(false)
 {
-    _db.setBusyTimeout(10 * 1000);
+    _db.setBusyTimeout(BUSY_TIMEOUT_MS);
     
     // Note: These are properties of the connection, so they must be set regardless
     // of whether the database setup queries are run.
@@ -96,14 +498,55 @@ MailStore::MailStore() :
     // A database page size of 8192 or 16384 gives the best performance for large BLOB I/O.
     SQLite::Statement(_db, "PRAGMA journal_mode = WAL").executeStep();
     SQLite::Statement(_db, "PRAGMA main.page_size = 4096").exec();
-    SQLite::Statement(_db, "PRAGMA main.cache_size = 10000").exec();
     SQLite::Statement(_db, "PRAGMA main.synchronous = NORMAL").exec();
+    // fire delete triggers for rows removed by REPLACE (see FolderBodyCounts)
+    SQLite::Statement(_db, "PRAGMA recursive_triggers = ON").exec();
+
+    // replaces SQLite's autocheckpoint with the policy in didCommitToWAL
+    sqlite3_wal_hook(_db.getHandle(), &sqliteWALHook, this);
+
+    _db.createFunction("mailsync_json_set_key", 3, true, nullptr, &sqliteJSONSetKey, nullptr, nullptr, nullptr);
+    _db.createFunction("mailsync_data_json", 1, true, nullptr, &sqliteDataJSON, nullptr, nullptr, nullptr);
+    _db.createFunction("mailsync_body", 1, true, nullptr, &sqliteBody, nullptr, nullptr, nullptr);
+    _db.createFunction("mailsync_body_compress", 1, true, nullptr, &sqliteBodyCompress, nullptr, nullptr, nullptr);
+    ValueSet::registerModule(_db);
+
+    // the page cache is sized by the process-wide budget
+    MemoryBudget::connectionOpened();
+    applyMemoryBudget();
+    if (MemoryBudget::mmapSize() > 0) {
+        SQLite::Statement(_db, "PRAGMA main.mmap_size = " + to_string(MemoryBudget::mmapSize())).executeStep();
+    }
+
+    // The _State table doesn't exist until the first migration, in which case
+    // we're using the default (text) encoding anyway.
+    try {
+        _compressedBodies = (getKeyValue(BODY_ENCODING_KEY) == BODY_ENCODING_COMPRESSED);
+    } catch (SQLite::Exception & ex) {
+    }
+}
+
+MailStore::~MailStore() {
+    MemoryBudget::connectionClosed();
 }
 
-static int CURRENT_VERSION = 8;
+static int CURRENT_VERSION = 13;
 static string VACUUM_TIME_KEY = "VACUUM_TIME";
 static time_t VACUUM_INTERVAL = 14 * 24 * 60 * 60; // 14 days
 
+// Converting an existing database to auto_vacuum=INCREMENTAL. VACUUM_CONVERT_MAX_MS
+// must stay below BUSY_TIMEOUT_MS. See convertToIncrementalVacuum.
+static int VACUUM_CONVERT_MAX_MS = 8 * 1000;
+static int VACUUM_CONVERT_BUSY_TIMEOUT_MS = 250;
+#define VACUUM_CONVERT_PROGRESS_OPS 10000
+
+// Incremental vacuum tuning, in 4KB pages. See vacuumIncrementally.
+#define AUTO_VACUUM_INCREMENTAL 2
+static long long INCREMENTAL_VACUUM_MIN_FREE_PAGES = 2560; // 10MB
+static int INCREMENTAL_VACUUM_SLICE_PAGES = 256; // 1MB
+static int INCREMENTAL_VACUUM_MAX_SLICES = 64;
+static int INCREMENTAL_VACUUM_SLICE_PAUSE_MS = 50;
+
 void MailStore::migrate() {
     SQLite::Statement uv(_db, "PRAGMA user_version");
     uv.executeStep();
@@ -111,6 +554,11 @@ void MailStore::migrate() {
     uv.reset();
     
     string verb = version == 0 ? "Setup" : "Migration";
+
+    // This only takes effect before the first table is created
+    if (version == 0) {
+        SQLite::Statement(_db, "PRAGMA auto_vacuum = INCREMENTAL").exec();
+    }
     
     if (version < 1) {
         for (string sql : V1_SETUP_QUERIES) {
@@ -150,6 +598,41 @@ void MailStore::migrate() {
             SQLite::Statement(_db, sql).exec();
         }
     }
+    if (version < 9) {
+        for (string sql : V9_SETUP_QUERIES) {
+            SQLite::Statement(_db, sql).exec();
+        }
+        migrateLabelIds();
+    }
+    if (version < 10) {
+        for (string sql : V10_SETUP_QUERIES) {
+            SQLite::Statement(_db, sql).exec();
+        }
+    }
+    if (version < 11) {
+        for (string sql : V11_SETUP_QUERIES) {
+            SQLite::Statement(_db, sql).exec();
+        }
+    }
+    if (version < 12) {
+        for (string sql : V12_SETUP_QUERIES) {
+            SQLite::Statement(_db, sql).exec();
+        }
+    }
+    if (version < 13) {
+        // Re-indexes every thread - display window. This drops ThreadSearch, so it
+        // must not be left half done.
+        cout << "\nRunning " << verb;
+        cout.flush();
+        MailStoreTransaction transaction{this, "migrate"};
+        for (string sql : V13_SETUP_QUERIES) {
+            SQLite::Statement(_db, sql).exec();
+        }
+        transaction.commit();
+    }
+    if (version < CURRENT_VERSION) {
+        repairFolderBodyCounts();
+    }
     
     // Update the version flag. Note that we don't want to go from v3 back to v2
     // if the user re-opens an older version of the app.
@@ -157,28 +640,242 @@ void MailStore::migrate() {
         SQLite::Statement(_db, "PRAGMA user_version = " + to_string(CURRENT_VERSION)).exec();
     }
 
-    // Initialize VACUUM timer if we're on version 0, but make everyone coming
-    // from old versions VACUUM for the first time.
-    if (version == 0) saveKeyValue(VACUUM_TIME_KEY, to_string(time(0)));
+    // Existing databases are converted to auto_vacuum=INCREMENTAL while idle rather
+    // than here, where a full VACUUM would hold up launch. See convertToIncrementalVacuum.
+}
+
+static int sqliteVacuumProgress(void * context) {
+    // returning non-zero interrupts the VACUUM
+    auto deadline = (chrono::steady_clock::time_point *)context;
+    return chrono::steady_clock::now() > *deadline ? 1 : 0;
+}
+
+/*
+ Converts a database created before auto_vacuum=INCREMENTAL to it, which requires
+ one full VACUUM. The VACUUM holds the write lock throughout, so it's only attempted
+ while the worker is idle, skipped if another connection is writing, and abandoned
+ after VACUUM_CONVERT_MAX_MS - before other connections waiting for the lock would
+ give up. After an attempt that ran, the next waits for VACUUM_INTERVAL.
+ Returns true if the database was converted.
+ */
+bool MailStore::convertToIncrementalVacuum() {
+    assertCorrectThread();
+
+    SQLite::Statement av(_db, "PRAGMA auto_vacuum");
+    av.executeStep();
+    bool incremental = av.getColumn(0).getInt() == AUTO_VACUUM_INCREMENTAL;
+    av.reset();
+    if (incremental) {
+        return false;
+    }
+
     string vacuumTimeS = getKeyValue(VACUUM_TIME_KEY);
     time_t vacuumTime = vacuumTimeS != "" ? stol(vacuumTimeS) : 0;
+    if (time(0) - vacuumTime < VACUUM_INTERVAL) {
+        return false;
+    }
+
+    auto start = chrono::steady_clock::now();
+    auto deadline = start + chrono::milliseconds(VACUUM_CONVERT_MAX_MS);
+    sqlite3 * handle = _db.getHandle();
+    sqlite3_busy_timeout(handle, VACUUM_CONVERT_BUSY_TIMEOUT_MS);
+    sqlite3_progress_handler(handle, VACUUM_CONVERT_PROGRESS_OPS, &sqliteVacuumProgress, &deadline);
+    int rc = sqlite3_exec(handle, "PRAGMA auto_vacuum = INCREMENTAL; VACUUM", nullptr, nullptr, nullptr);
+    sqlite3_progress_handler(handle, 0, nullptr, nullptr);
+    sqlite3_busy_timeout(handle, BUSY_TIMEOUT_MS);
+    auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
 
-    // VACUUM if it's been a while
-    if (time(0) - vacuumTime > VACUUM_INTERVAL) {
-        cout << "\nRunning Vacuum\n";
+    auto logger = spdlog::get("logger");
+    if (rc == SQLITE_BUSY) {
+        // another connection is writing - try again the next time we're idle
+        logger->info("Incremental vacuum conversion skipped: database busy.");
+        return false;
+    }
+
+    // Vacuuming can fail if we run out of disk space, or take too long on a large
+    // database. Neither is likely to change soon, so wait for the interval either way.
+    saveKeyValue(VACUUM_TIME_KEY, to_string(time(0)));
+    if (rc == SQLITE_INTERRUPT) {
+        logger->warn("Incremental vacuum conversion abandoned after {}ms.", ms);
+    } else if (rc != SQLITE_OK) {
+        logger->warn("Incremental vacuum conversion failed: {}", sqlite3_errmsg(handle));
+    } else {
+        logger->info("Converted database to incremental vacuum in {}ms.", ms);
+    }
+    return rc == SQLITE_OK;
+}
+
+/*
+ Reclaims free pages in slices of INCREMENTAL_VACUUM_SLICE_PAGES once the freelist
+ grows past INCREMENTAL_VACUUM_MIN_FREE_PAGES. Each slice is a short write transaction,
+ so other workers can take the write lock in between. Call while the worker is idle.
+ Returns the number of pages reclaimed.
+ */
+long long MailStore::vacuumIncrementally() {
+    assertCorrectThread();
+
+    SQLite::Statement av(_db, "PRAGMA auto_vacuum");
+    av.executeStep();
+    if (av.getColumn(0).getInt() != AUTO_VACUUM_INCREMENTAL) {
+        return 0;
+    }
+
+    SQLite::Statement freelist(_db, "PRAGMA freelist_count");
+    freelist.executeStep();
+    long long free = freelist.getColumn(0).getInt64();
+    freelist.reset();
+    if (free < INCREMENTAL_VACUUM_MIN_FREE_PAGES) {
+        return 0;
+    }
+
+    long long initial = free;
+    auto start = chrono::steady_clock::now();
+    SQLite::Statement vacuum(_db, "PRAGMA incremental_vacuum(" + to_string(INCREMENTAL_VACUUM_SLICE_PAGES) + ")");
+
+    for (int slice = 0; slice < INCREMENTAL_VACUUM_MAX_SLICES && free > 0; slice ++) {
+        // the pragma returns an empty row for each page it frees
+        while (vacuum.executeStep()) {}
+        vacuum.reset();
+
+        freelist.executeStep();
+        long long remaining = freelist.getColumn(0).getInt64();
+        freelist.reset();
+        if (remaining >= free) {
+            break;
+        }
+        free = remaining;
+        std::this_thread::sleep_for(chrono::milliseconds(INCREMENTAL_VACUUM_SLICE_PAUSE_MS));
+    }
+
+    auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    spdlog::get("logger")->info("Incremental vacuum: reclaimed {} of {} free pages in {}ms.", initial - free, initial, ms);
+    return initial - free;
+}
+
+/*
+ Recomputes the body sync progress counters maintained by the FolderBodyCounts
+ triggers. This scans every folder, so it's only run after migrations.
+ */
+void MailStore::repairFolderBodyCounts() {
+    for (string sql : FOLDER_BODY_COUNTS_REPAIR_QUERIES) {
+        SQLite::Statement(_db, sql).exec();
+    }
+}
+
+/*
+ Rewrites any `data` values stored as CBOR by the removed `migrate-data-cbor` mode
+ as JSON text, which is the only form the client can read. Safe to run repeatedly
+ and to interrupt - reads accept either form. Logs the size of the data and the
+ time taken.
+ */
+void MailStore::migrateDataToJSON() {
+    assertCorrectThread();
+
+    for (string table : DATA_ENCODING_TABLES) {
+        auto start = chrono::steady_clock::now();
+        MailStoreTransaction transaction{this, "migrateDataToJSON"};
+
+        SQLite::Statement size(_db, "SELECT COUNT(*), SUM(LENGTH(data)) FROM " + table);
+        size.executeStep();
+        long long rows = size.getColumn(0).getInt64();
+        long long before = size.getColumn(1).getInt64();
+        size.reset();
+
+        SQLite::Statement update(_db, "UPDATE " + table + " SET data = mailsync_data_json(data) WHERE typeof(data) = 'blob'");
+        int changed = update.exec();
+
+        size.executeStep();
+        long long after = size.getColumn(1).getInt64();
+        size.reset();
+        transaction.commit();
+
+        auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+        cout << "\n" << table << ": converted " << changed << " of " << rows << " rows in " << ms << "ms, data " << before << " => " << after << " bytes";
         cout.flush();
-        
-        // Update vacuum timer first so we don't re-attempt vacuuming if it fails
-        saveKeyValue(VACUUM_TIME_KEY, to_string(time(0)));
-        
-        try {
-            SQLite::Statement(_db, "VACUUM").exec();
-        } catch (std::exception & ex) {
-            // Vacuuming can fail if we run out of disk space and isn't mandatory,
-            // so we fail silently and still return 0 to allow the app to launch.
-            cout << "\n" << "Vacuuming failed with SQLite error:";
-            cout << "\n" << ex.what();
+    }
+
+    saveKeyValue(DATA_ENCODING_KEY, DATA_ENCODING_JSON);
+
+    SQLite::Statement pageCount(_db, "PRAGMA page_count");
+    SQLite::Statement pageSize(_db, "PRAGMA page_size");
+    if (pageCount.executeStep() && pageSize.executeStep()) {
+        long long bytes = pageCount.getColumn(0).getInt64() * pageSize.getColumn(0).getInt64();
+        cout << "\nDatabase size: " << bytes << " bytes (run VACUUM to reclaim free pages)\n";
+        cout.flush();
+    }
+}
+
+/*
+ Converts existing message bodies and thread search bodies to (or from) compressed
+ storage and switches the format used for new ones. Logs the size change, and the
+ time and page cache hit rate of reading every body back, so the formats can be
+ compared on a corpus.
+
+ Compressed bodies are BLOBs that only mailsync's connections can decode with
+ mailsync_body(). Other readers (the client) can decode them with zlib and the
+ preset dictionaries written to BodyCodecDictionary - see BodyCodec.hpp. The
+ ThreadSearchSource view can't do either, so ThreadSearch snippets and highlights
+ don't include the body of compressed rows.
+ */
+void MailStore::migrateBodyEncoding(bool compressed) {
+    assertCorrectThread();
+    vector<pair<string, string>> bodyColumns = {{"MessageBody", "value"}, {"ThreadSearchContent", "body"}};
+
+    for (auto & column : bodyColumns) {
+        auto start = chrono::steady_clock::now();
+        MailStoreTransaction transaction{this, "migrateBodyEncoding"};
+
+        if (compressed) {
+            SQLite::Statement(_db, "CREATE TABLE IF NOT EXISTS `" + BODY_CODEC_DICTIONARY_TABLE + "` (tag INTEGER PRIMARY KEY, dictionary BLOB)").exec();
+            SQLite::Statement dict(_db, "REPLACE INTO `" + BODY_CODEC_DICTIONARY_TABLE + "` (tag, dictionary) VALUES (?, ?)");
+            string dictionary = BodyCodec::dictionary(BODY_CODEC_DEFLATE_DICT_V1);
+            dict.bind(1, BODY_CODEC_DEFLATE_DICT_V1);
+            dict.bind(2, dictionary.data(), (int)dictionary.length());
+            dict.exec();
         }
+
+        SQLite::Statement size(_db, "SELECT COUNT(*), SUM(LENGTH(CAST(" + column.second + " AS BLOB))) FROM " + column.first);
+        size.executeStep();
+        long long rows = size.getColumn(0).getInt64();
+        long long before = size.getColumn(1).getInt64();
+        size.reset();
+
+        // The text indexed in ThreadSearch doesn't change, so the index is still valid.
+        string fn = compressed ? "mailsync_body_compress" : "mailsync_body";
+        SQLite::Statement update(_db, "UPDATE " + column.first + " SET " + column.second + " = " + fn + "(" + column.second + ") WHERE typeof(" + column.second + ") = ?");
+        update.bind(1, compressed ? "text" : "blob");
+        int changed = update.exec();
+
+        size.executeStep();
+        long long after = size.getColumn(1).getInt64();
+        size.reset();
+        transaction.commit();
+
+        auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+        cout << "\n" << column.first << ": converted " << changed << " of " << rows << " rows in " << ms << "ms, " << column.second << " " << before << " => " << after << " bytes";
+        cout.flush();
+    }
+
+    saveKeyValue(BODY_ENCODING_KEY, compressed ? BODY_ENCODING_COMPRESSED : BODY_ENCODING_TEXT);
+    _compressedBodies = compressed;
+
+    int hits = 0, misses = 0, unused = 0;
+    sqlite3_db_status(_db.getHandle(), SQLITE_DBSTATUS_CACHE_HIT, &unused, &unused, 1);
+    sqlite3_db_status(_db.getHandle(), SQLITE_DBSTATUS_CACHE_MISS, &unused, &unused, 1);
+    auto start = chrono::steady_clock::now();
+    SQLite::Statement load(_db, "SELECT SUM(LENGTH(mailsync_body(value))) FROM MessageBody");
+    load.executeStep();
+    auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    sqlite3_db_status(_db.getHandle(), SQLITE_DBSTATUS_CACHE_HIT, &hits, &unused, 0);
+    sqlite3_db_status(_db.getHandle(), SQLITE_DBSTATUS_CACHE_MISS, &misses, &unused, 0);
+    cout << "\nLoaded " << load.getColumn(0).getInt64() << " body bytes in " << ms << "ms, page cache hits " << hits << ", misses " << misses;
+
+    SQLite::Statement pageCount(_db, "PRAGMA page_count");
+    SQLite::Statement pageSize(_db, "PRAGMA page_size");
+    if (pageCount.executeStep() && pageSize.executeStep()) {
+        long long bytes = pageCount.getColumn(0).getInt64() * pageSize.getColumn(0).getInt64();
+        cout << "\nDatabase size: " << bytes << " bytes (run VACUUM to reclaim free pages)\n";
+        cout.flush();
     }
 }
 
@@ -211,45 +908,151 @@ void MailStore::resetForAccount(string accountId) {
     SQLite::Statement(_db, "VACUUM").exec();
 }
 
-SQLite::Database & MailStore::db()
-{
-    return this->_db;
-}
+/*
+ Moves an account's data out of the shared database and into its own database file,
+ which subsequent launches for the account open instead. Call on a store opened on
+ the shared database. Once moved, resetting the account deletes the file rather
+ than deleting rows from every table and vacuuming the shared database.
+
+ The same transaction records the account in the shared database's list of moved
+ accounts, and the SQL readers of the shared database run to see its rows - see
+ saveAccountDatabases.
 
-map<uint32_t, MessageAttributes> MailStore::fetchMessagesAttributesInRange(Range range, Folder & folder) {
+ The file is built under a temporary name and renamed into place only once the
+ account's rows have been deleted from the shared database, just before that
+ deletion commits. If anything fails, the temporary file is removed and the
+ shared database is left as it was.
+ */
+void MailStore::moveAccountToDatabase(string accountId) {
     assertCorrectThread();
-    SQLite::Statement query(this->_db, "SELECT id, unread, starred, remoteUID, remoteXGMLabels FROM Message WHERE accountId = ? AND remoteFolderId = ? AND remoteUID >= ? AND remoteUID <= ?");
-    query.bind(1, folder.accountId());
-    query.bind(2, folder.id());
-    query.bind(3, (long long)(range.location));
-    
-    // Range is uint64_t, and "*" is represented by UINT64_MAX.
-    // SQLite doesn't support UINT64 and the conversion /can/ fail.
-    if (range.length == UINT64_MAX) {
-        query.bind(4, LLONG_MAX);
-    } else {
-        query.bind(4, (long long)(range.location + range.length));
+    if (accountDatabaseId != "" || accountDatabaseExists(accountId)) {
+        throw SyncException("invalid-state", "The account already has its own database file.", false);
     }
 
-    map<uint32_t, MessageAttributes> results {};
+    auto start = chrono::steady_clock::now();
+    string path = databasePathForAccount(accountId);
+    string buildPath = path + ".moving";
+    removeAccountDatabaseFile(buildPath);
 
-    while (query.executeStep()) {
-        MessageAttributes attrs{};
-        uint32_t uid = (uint32_t)query.getColumn("remoteUID").getInt64();
-        attrs.uid = uid;
-        attrs.starred = query.getColumn("starred").getInt() != 0;
-        attrs.unread = query.getColumn("unread").getInt() != 0;
-        
-        vector<string> labels{};
-        for (const auto i : json::parse(query.getColumn("remoteXGMLabels").getString())) {
-            labels.push_back(i.get<string>());
+    try {
+        {
+            // create the account database and its schema
+            MailStore accountStore(buildPath);
+            accountStore.migrate();
+
+            SQLite::Database & db = accountStore.db();
+            SQLite::Statement attach(db, "ATTACH DATABASE ? AS shared");
+            attach.bind(1, databasePath());
+            attach.exec();
+
+            {
+                MailStoreTransaction transaction{&accountStore, "moveAccountToDatabase"};
+                SQLite::Statement(db, "INSERT OR REPLACE INTO main._State SELECT * FROM shared._State").exec();
+
+                for (string sql : ACCOUNT_MOVE_QUERIES) {
+                    // name the columns, and keep rowids - ThreadSearch rows are referenced by rowid
+                    string table = sql.substr(sql.find('`') + 1);
+                    table = table.substr(0, table.find('`'));
+                    string columns = "rowid, " + columnsOfTable(db, "main", table);
+                    string prefix = "INSERT INTO main.`" + table + "` SELECT *";
+                    sql = "INSERT INTO main.`" + table + "` (" + columns + ") SELECT " + columns + sql.substr(prefix.length());
+
+                    SQLite::Statement statement {db, sql};
+                    statement.bind(1, accountId);
+                    int copied = statement.exec();
+                    cout << "\n" << table << ": " << copied << " rows";
+                    cout.flush();
+                }
+                // ThreadSearch only indexes ThreadSearchContent, so it's rebuilt from the copy
+                SQLite::Statement(db, THREAD_SEARCH_REINDEX_QUERY).exec();
+                accountStore.repairFolderBodyCounts();
+                transaction.commit();
+            }
+            SQLite::Statement(db, "DETACH DATABASE shared").exec();
+
+            // fold the WAL into the file so it can be renamed on its own
+            if (!accountStore.checkpoint(SQLITE_CHECKPOINT_TRUNCATE, BUSY_TIMEOUT_MS)) {
+                throw SyncException("database-busy", "Unable to checkpoint the new account database.", false);
+            }
         }
-        attrs.labels = labels;
 
-        results[uid] = attrs;
+        // remove the account's rows from the shared database. The free pages are
+        // reclaimed by the incremental vacuum, not a full VACUUM.
+        MailStoreTransaction transaction{this, "moveAccountToDatabase"};
+        for (auto queries : {ACCOUNT_MOVE_DELETE_QUERIES, ACCOUNT_RESET_QUERIES}) {
+            for (string sql : queries) {
+                SQLite::Statement statement {_db, sql};
+                statement.bind(1, accountId);
+                statement.exec();
+            }
+        }
+        auto accountIds = accountDatabaseIds();
+        accountIds.push_back(accountId);
+        saveAccountDatabases(accountIds);
+
+        if (!renameFile(buildPath, path)) {
+            throw SyncException("rename-failed", "Unable to move the new account database into place.", false);
+        }
+        try {
+            transaction.commit();
+        } catch (...) {
+            // the rows are still in the shared database, so the copy must not be used
+            removeAccountDatabaseFile(path);
+            throw;
+        }
+    } catch (...) {
+        removeAccountDatabaseFile(buildPath);
+        throw;
     }
-    
-    return results;
+
+    auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    cout << "\nMoved account " << accountId << " to " << path << " in " << ms << "ms";
+
+    // read the account back the way the client will, through the combined views
+    SQLite::Database reader(databasePath(), SQLite::OPEN_READONLY);
+    reader.exec(getKeyValue(ACCOUNT_DATABASES_SQL_KEY));
+    SQLite::Statement visible(reader, "SELECT COUNT(*) FROM Message WHERE accountId = ?");
+    visible.bind(1, accountId);
+    visible.executeStep();
+    cout << "\nMessages visible through the shared database: " << visible.getColumn(0).getInt64() << "\n";
+    cout.flush();
+}
+
+/*
+ Attaches the database files of the given accounts to this connection and creates the
+ combined views described in accountDatabasesSQL. Only for connections used to read -
+ writes to the shadowed tables fail once the views exist.
+ */
+void MailStore::attachAccountDatabases(vector<string> accountIds) {
+    assertCorrectThread();
+    _db.exec(accountDatabasesSQL(_db, accountIds));
+}
+
+/*
+ Returns the accounts that have been moved out of this (shared) database.
+ */
+vector<string> MailStore::accountDatabaseIds() {
+    string value = getKeyValue(ACCOUNT_DATABASES_KEY);
+    if (value == "") {
+        return {};
+    }
+    return json::parse(value).get<vector<string>>();
+}
+
+/*
+ Records the accounts that have been moved out of this (shared) database, along with
+ the SQL from accountDatabasesSQL. The client runs that SQL on each connection it opens
+ on the shared database, so moved accounts stay visible to it. It's regenerated by
+ --mode migrate, since the views name the columns of each table.
+ */
+void MailStore::saveAccountDatabases(vector<string> accountIds) {
+    saveKeyValue(ACCOUNT_DATABASES_KEY, json(accountIds).dump());
+    saveKeyValue(ACCOUNT_DATABASES_SQL_KEY, accountDatabasesSQL(_db, accountIds));
+}
+
+SQLite::Database & MailStore::db()
+{
+    return this->_db;
 }
 
 uint32_t MailStore::fetchMessageUIDAtDepth(Folder & folder, uint32_t depth, uint32_t before) {
@@ -266,6 +1069,147 @@ uint32_t MailStore::fetchMessageUIDAtDepth(Folder & folder, uint32_t depth, uint
     return 1;
 }
 
+/*
+ Returns the folder's local UIDs and attributes. The first call loads them from the
+ database, subsequent calls are served from memory. The result includes changes made
+ in this store's open transaction. Unlinked messages (remoteUID > LOCAL_FOLDER_UID_MAX)
+ are not included. Release the result before saving messages in the folder, or the
+ shared copy has to be duplicated to apply them.
+ */
+shared_ptr<const LocalFolderUIDs> MailStore::fetchLocalFolderUIDs(Folder & folder) {
+    assertCorrectThread();
+    shared_ptr<const LocalFolderUIDs> shared = nullptr;
+    int generation = 0;
+    if (!_folderUIDsInvalidated.count(folder.id())) {
+        std::lock_guard<std::mutex> lock(sharedFolderUIDsMtx);
+        auto it = sharedFolderUIDs.find(folder.id());
+        if (it != sharedFolderUIDs.end()) {
+            shared = it->second;
+        }
+        generation = sharedFolderUIDsGenerations[folder.id()];
+    }
+
+    if (shared != nullptr) {
+        // overlay the changes we haven't committed yet
+        shared_ptr<LocalFolderUIDs> result = nullptr;
+        for (auto & change : _folderUIDChanges) {
+            if (change.folderId != folder.id()) {
+                continue;
+            }
+            if (result == nullptr) {
+                result = make_shared<LocalFolderUIDs>(*shared);
+            }
+            if (change.add) {
+                result->add(change.uid, change.unread, change.starred, change.labelIds);
+            } else {
+                result->remove(change.uid);
+            }
+        }
+        return result != nullptr ? result : shared;
+    }
+
+    auto result = make_shared<LocalFolderUIDs>();
+    SQLite::Statement query(this->_db, "SELECT unread, starred, remoteUID, remoteXGMLabels, remoteXGMLabelIds FROM Message WHERE accountId = ? AND remoteFolderId = ? AND remoteUID <= ?");
+    query.bind(1, folder.accountId());
+    query.bind(2, folder.id());
+    query.bind(3, (long long)LOCAL_FOLDER_UID_MAX);
+    while (query.executeStep()) {
+        uint32_t uid = (uint32_t)query.getColumn("remoteUID").getInt64();
+        // every row has label ids since the V9 migration - see migrateLabelIds
+        vector<uint32_t> labelIds{};
+        SQLite::Column packed = query.getColumn("remoteXGMLabelIds");
+        if (packed.isBlob()) {
+            labelIds = unpackLabelIds(packed.getBlob(), packed.getBytes());
+        }
+        result->add(uid, query.getColumn("unread").getInt() != 0, query.getColumn("starred").getInt() != 0, labelIds);
+    }
+
+    // the query sees our uncommitted changes, so the result can't be shared until they're committed
+    if (!_transactionOpen) {
+        std::lock_guard<std::mutex> lock(sharedFolderUIDsMtx);
+        if (sharedFolderUIDsGenerations[folder.id()] == generation) {
+            sharedFolderUIDs[folder.id()] = result;
+        }
+    }
+    return result;
+}
+
+/*
+ Call after changing the remoteUID or remoteFolderId of many messages in a folder
+ without saving the models (eg: with a set-based UPDATE). The folder's UIDs are
+ reloaded the next time they're fetched. Takes effect when the open transaction
+ commits.
+ */
+void MailStore::invalidateLocalFolderUIDs(const string & folderId) {
+    if (_transactionOpen) {
+        _folderUIDsInvalidated.insert(folderId);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(sharedFolderUIDsMtx);
+    sharedFolderUIDsGenerations[folderId] += 1;
+    sharedFolderUIDs.erase(folderId);
+}
+
+/*
+ Call after unlinking messages with a set-based UPDATE. Removes their UIDs from
+ the folder's cached UIDs, or reloads the folder if there are so many that
+ removing them one by one would cost more.
+ */
+void MailStore::didUnlinkMessageUIDs(const string & folderId, const vector<uint32_t> & uids) {
+    if (uids.size() > LOCAL_FOLDER_UID_CHANGES_MAX) {
+        invalidateLocalFolderUIDs(folderId);
+        return;
+    }
+    for (uint32_t uid : uids) {
+        _recordFolderUIDsChange({folderId, uid, false, false, false, {}});
+    }
+}
+
+void MailStore::_didSaveMessage(Message * message, const json & previous) {
+    if (previous.is_object()) {
+        _recordFolderUIDsChange({previous["remoteFolderId"].get<string>(), previous["remoteUID"].get<uint32_t>(), false, false, false, {}});
+    }
+    uint32_t uid = message->remoteUID();
+    if (uid <= LOCAL_FOLDER_UID_MAX) {
+        vector<uint32_t> labelIds = labelIdsForLabels(message->accountId(), message->remoteXGMLabels().get<vector<string>>());
+        _recordFolderUIDsChange({message->remoteFolderId(), uid, true, message->isUnread(), message->isStarred(), labelIds});
+    }
+}
+
+void MailStore::_didRemoveMessage(Message * message) {
+    const json & saved = message->_savedIndexedValues;
+    string folderId = saved.is_object() ? saved["remoteFolderId"].get<string>() : message->remoteFolderId();
+    uint32_t uid = saved.is_object() ? saved["remoteUID"].get<uint32_t>() : message->remoteUID();
+    _recordFolderUIDsChange({folderId, uid, false, false, false, {}});
+}
+
+void MailStore::_recordFolderUIDsChange(LocalFolderUIDsChange change) {
+    if (_transactionOpen) {
+        _folderUIDChanges.push_back(change);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(sharedFolderUIDsMtx);
+    applySharedFolderUIDsChange(change);
+}
+
+void MailStore::_publishFolderUIDsChanges() {
+    if (_folderUIDChanges.empty() && _folderUIDsInvalidated.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(sharedFolderUIDsMtx);
+    for (auto & change : _folderUIDChanges) {
+        if (!_folderUIDsInvalidated.count(change.folderId)) {
+            applySharedFolderUIDsChange(change);
+        }
+    }
+    for (auto & folderId : _folderUIDsInvalidated) {
+        sharedFolderUIDsGenerations[folderId] += 1;
+        sharedFolderUIDs.erase(folderId);
+    }
+    _folderUIDChanges = {};
+    _folderUIDsInvalidated = {};
+}
+
 string MailStore::getKeyValue(string key) {
     assertCorrectThread();
     SQLite::Statement query(this->_db, "SELECT value FROM _State WHERE id = ?");
@@ -285,20 +1229,143 @@ void MailStore::saveKeyValue(string key, string value) {
     query.exec();
 }
 
-vector<shared_ptr<Label>> MailStore::allLabelsCache(string accountId) {
-    // todo bg: this assumes a single accountId will ever be used
-    if (_labelCacheVersion != globalLabelsVersion) {
-        _labelCache = findAll<Label>(Query().equal("accountId", accountId));
-        _labelCacheVersion = globalLabelsVersion;
+shared_ptr<const LabelSnapshot> MailStore::labelSnapshot(string accountId) {
+    assertCorrectThread();
+    if (_labelsChanged) {
+        // our uncommitted changes aren't visible to other threads yet
+        if (_privateLabelSnapshot == nullptr) {
+            _privateLabelSnapshot = make_shared<LabelSnapshot>(findAll<Label>(Query().equal("accountId", accountId)), 0);
+        }
+        return _privateLabelSnapshot;
+    }
+
+    auto snapshot = LabelSnapshot::shared(accountId);
+    if (snapshot == nullptr) {
+        int generation = LabelSnapshot::sharedGeneration();
+        snapshot = make_shared<LabelSnapshot>(findAll<Label>(Query().equal("accountId", accountId)), generation);
+        LabelSnapshot::publish(accountId, snapshot);
+    }
+    return snapshot;
+}
+
+void MailStore::_didChangeLabels() {
+    if (_transactionOpen) {
+        _labelsChanged = true;
+        _privateLabelSnapshot = nullptr;
+    } else {
+        LabelSnapshot::invalidateShared();
+    }
+}
+
+/*
+ Returns the label dictionary indexes of `labels` without adding to the dictionary,
+ so it's safe to call from read paths. Labels that aren't in the dictionary yet
+ are LABEL_ID_UNKNOWN, which no stored message has.
+ */
+vector<uint32_t> MailStore::labelIdsForLabels(string accountId, const vector<string> & labels) {
+    vector<uint32_t> ids{};
+    ids.reserve(labels.size());
+    for (const auto & label : labels) {
+        ids.push_back(_labelIdFor(accountId, label, false));
+    }
+    sort(ids.begin(), ids.end());
+    return ids;
+}
+
+/*
+ Returns the packed label dictionary indexes of `labels` for saving a message,
+ adding labels that aren't in the dictionary yet. Call within the transaction
+ that saves the message.
+ */
+string MailStore::packedLabelIdsForLabels(string accountId, const vector<string> & labels) {
+    vector<uint32_t> ids{};
+    ids.reserve(labels.size());
+    for (const auto & label : labels) {
+        ids.push_back(_labelIdFor(accountId, label, true));
     }
-    return _labelCache;
+    sort(ids.begin(), ids.end());
+    return packLabelIds(ids);
+}
+
+/*
+ Fills in remoteXGMLabelIds for messages saved before the label dictionary was
+ added. Run by the V9 migration.
+ */
+void MailStore::migrateLabelIds() {
+    MailStoreTransaction transaction{this, "migrateLabelIds"};
+    SQLite::Statement query(_db, "SELECT id, accountId, remoteXGMLabels FROM Message WHERE remoteXGMLabelIds IS NULL");
+    SQLite::Statement update(_db, "UPDATE Message SET remoteXGMLabelIds = ? WHERE id = ?");
+    while (query.executeStep()) {
+        vector<string> labels{};
+        for (const auto i : json::parse(query.getColumn("remoteXGMLabels").getString())) {
+            labels.push_back(i.get<string>());
+        }
+        string packed = packedLabelIdsForLabels(query.getColumn("accountId").getString(), labels);
+        update.bind(1, packed.data(), (int)packed.size());
+        update.bind(2, query.getColumn("id").getString());
+        update.exec();
+        update.reset();
+    }
+    transaction.commit();
+}
+
+uint32_t MailStore::_labelIdFor(string accountId, const string & label, bool assign) {
+    assertCorrectThread();
+    if (_labelIdsAccountId != accountId) {
+        _labelIds = {};
+        _labelIdsAccountId = accountId;
+        SQLite::Statement all(this->_db, "SELECT value, idx FROM LabelDictionary WHERE accountId = ?");
+        all.bind(1, accountId);
+        while (all.executeStep()) {
+            _labelIds[all.getColumn(0).getString()] = all.getColumn(1).getUInt();
+        }
+    }
+
+    auto it = _labelIds.find(label);
+    if (it != _labelIds.end()) {
+        return it->second;
+    }
+
+    // Another worker may have added the label since we loaded the dictionary
+    auto find = cachedStatement("SELECT idx FROM LabelDictionary WHERE accountId = ? AND value = ?");
+    find->bind(1, accountId);
+    find->bind(2, label);
+    if (find->executeStep()) {
+        uint32_t idx = find->getColumn(0).getUInt();
+        find->reset();
+        _labelIds[label] = idx;
+        return idx;
+    }
+    find->reset();
+    if (!assign) {
+        return LABEL_ID_UNKNOWN;
+    }
+
+    // Another worker may add the same label concurrently, so insert if missing
+    // and then read back whichever index won.
+    auto insert = cachedStatement("INSERT OR IGNORE INTO LabelDictionary (accountId, value, idx) SELECT ?, ?, IFNULL(MAX(idx), 0) + 1 FROM LabelDictionary WHERE accountId = ?");
+    insert->bind(1, accountId);
+    insert->bind(2, label);
+    insert->bind(3, accountId);
+    insert->exec();
+
+    if (!find->executeStep()) {
+        throw SyncException("assertion-failure", "LabelDictionary entry missing after insert", false);
+    }
+    uint32_t idx = find->getColumn(0).getUInt();
+    find->reset();
+    _labelIds[label] = idx;
+    return idx;
 }
 
 void MailStore::beginTransaction() {
     assertCorrectThread();
+    applyMemoryBudget();
     _stmtBeginTransaction.exec();
     _stmtBeginTransaction.reset();
     _transactionOpen = true;
+    _deferredModels = {};
+    _deferredDirty = {};
 }
 
 
@@ -308,9 +1375,28 @@ void MailStore::rollbackTransaction() {
     _saveUpdateQueries = {};
     _saveInsertQueries = {};
     _removeQueries = {};
+    _saveDataQueries = {};
+    _findQueries.clear();
+    _deferredModels = {};
+    _deferredDirty = {};
+    // label indexes assigned within the transaction are being rolled back
+    _labelIds = {};
+    _labelIdsAccountId = "";
+    _privateLabelSnapshot = nullptr;
+
+    _labelsChanged = false;
     _stmtRollbackTransaction.exec();
     _stmtRollbackTransaction.reset();
     _transactionOpen = false;
+    _transactionRollbacks += 1;
+
+    // these changes were never committed, so the shared folder UIDs are still correct
+    _folderUIDChanges = {};
+    _folderUIDsInvalidated = {};
+
+    // The changes these deltas describe were never committed. Don't let them be
+    // emitted along with the next transaction.
+    _transactionDeltas = {};
 }
 
 // This method allows you to perform work in a transaction and then prevent the
@@ -319,80 +1405,156 @@ void MailStore::rollbackTransaction() {
 // client falling out of sync and it can be a performance win in key places where
 // many unnecessary updates would cause thrashing on the JS side.
 void MailStore::unsafeEraseTransactionDeltas() {
+    // write deferred changes first so their deltas are erased along with the rest
+    _flushDeferredSaves();
     _transactionDeltas = {};
 }
 
+unsigned long MailStore::transactionRollbacks() {
+    // Models kept in memory across transactions may carry changes that were
+    // rolled back. Callers compare this count to know when to drop them.
+    return _transactionRollbacks;
+}
+
 void MailStore::commitTransaction() {
+    _flushDeferredSaves();
+    _deferredModels = {};
+
     _stmtCommitTransaction.exec();
     _stmtCommitTransaction.reset();
+    _transactionOpen = false;
+    _publishFolderUIDsChanges();
+
+    if (_labelsChanged) {
+        LabelSnapshot::invalidateShared();
+        _labelsChanged = false;
+        _privateLabelSnapshot = nullptr;
+    }
     
     // emit all of the deltas
     if (_transactionDeltas.size()) {
         SharedDeltaStream()->emit(_transactionDeltas, _streamMaxDelay);
         _transactionDeltas = {};
     }
-    _transactionOpen = false;
-
 }
 
 void MailStore::save(MailModel * model) {
     assertCorrectThread();
 
+    // If the model was loaded from (or last written to) the database and nothing
+    // has changed since, there's nothing to write and nothing to tell the client.
+    if (model->_savedDataHash != 0 && !model->hasPendingDispatch()) {
+        if (!model->_data.isInflated() || hash<string>()(model->serializedData()) == model->_savedDataHash) {
+            _savesSkipped += 1;
+            return;
+        }
+    }
+
     model->incrementVersion();
     model->beforeSave(this);
 
     auto tableName = model->tableName();
+    RowWriteStats & writeStats = _rowWrites[&model->schema()];
+    bool writeTimed = writeStats.rows % ROW_WRITE_SAMPLE_INTERVAL == 0;
+    auto writeStart = writeTimed ? chrono::steady_clock::now() : chrono::steady_clock::time_point();
+    model->_savedDataHash = 0;
     
-    if (model->version() > 1) {
+    if (model->version() > 1 && !model->_savedIndexedValues.is_null() && model->indexedValues() == model->_savedIndexedValues) {
+        // None of the indexed columns have changed, so only write the JSON. This avoids
+        // rewriting every index on the table.
+        if (!_saveDataQueries.count(tableName)) {
+            _saveDataQueries[tableName] = make_shared<SQLite::Statement>(this->_db, "UPDATE " + tableName + " SET data = ?2, version = ?4 WHERE id = ?1");
+        }
+        auto query = _saveDataQueries[tableName];
+        query->reset();
+        model->bindDataToQuery(query.get(), MODEL_COLUMN_DATA);
+        query->bind(MODEL_COLUMN_VERSION, model->version());
+        query->bind(MODEL_COLUMN_ID, model->id());
+        query->exec();
+        model->_savedDataHash = model->_boundDataHash;
+        _savesDataOnly += 1;
+
+    } else if (model->version() > 1) {
         if (!_saveUpdateQueries.count(tableName)) {
-            string pairs{""};
-            for (const auto col : model->columnsForQuery()) {
-                if (col == "id") {
-                    continue;
-                }
-                pairs += (col + " = :" + col + ",");
-            }
-            pairs.pop_back();
-            
-            auto stmt = make_shared<SQLite::Statement>(this->_db, "UPDATE " + tableName + " SET " + pairs + " WHERE id = :id");
-            _saveUpdateQueries[tableName] = stmt;
+            _saveUpdateQueries[tableName] = make_shared<SQLite::Statement>(this->_db, "UPDATE " + tableName + model->schema().updateSQL);
         }
         auto query = _saveUpdateQueries[tableName];
         query->reset();
         model->bindToQuery(query.get());
         query->exec();
+        model->_savedDataHash = model->_boundDataHash;
         
     } else {
         if (!_saveInsertQueries.count(tableName)) {
-            string cols{""};
-            string values{""};
-            for (const auto col : model->columnsForQuery()) {
-                cols += col + ",";
-                values += ":" + col + ",";
-            }
-            cols.pop_back();
-            values.pop_back();
-            
-            auto stmt = make_shared<SQLite::Statement>(this->_db, "INSERT INTO " + tableName + " (" + cols + ") VALUES (" + values + ")");
-            _saveInsertQueries[tableName] = stmt;
+            _saveInsertQueries[tableName] = make_shared<SQLite::Statement>(this->_db, "INSERT INTO " + tableName + model->schema().insertSQL);
         }
-        
+
         auto query = _saveInsertQueries[tableName];
         query->reset();
         model->bindToQuery(query.get());
         query->exec();
+        model->_savedDataHash = model->_boundDataHash;
+    }
+
+    if (writeTimed) {
+        writeStats.table = tableName;
+        writeStats.timed += 1;
+        writeStats.micros += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - writeStart).count();
+    }
+    writeStats.rows += 1;
+
+    json previousIndexedValues = std::move(model->_savedIndexedValues);
+    model->captureIndexedValues();
+
+    if (tableName == "Message" && previousIndexedValues != model->_savedIndexedValues) {
+        _didSaveMessage((Message *)model, previousIndexedValues);
+    }
+
+    if (_deferredDirty.size()) {
+        // if this is a model awaiting a deferred save, it's now up to date
+        auto it = _deferredModels.find(model->id());
+        if (it != _deferredModels.end() && it->second.get() == model) {
+            _deferredDirty.erase(model->id());
+        }
     }
 
     model->afterSave(this);
 
     if (tableName == "Label") {
-        globalLabelsVersion += 1;
+        _didChangeLabels();
     }
 
     DeltaStreamItem delta {DELTA_TYPE_PERSIST, model};
     _emit(delta);
 }
 
+void MailStore::saveDeferred(MailModel * model) {
+    assertCorrectThread();
+    auto it = _deferredModels.find(model->id());
+    if (!_transactionOpen || it == _deferredModels.end() || it->second.get() != model) {
+        save(model);
+        return;
+    }
+    _deferredDirty.insert(model->id());
+}
+
+void MailStore::_flushDeferredSaves() {
+    while (_deferredDirty.size()) {
+        string id = *_deferredDirty.begin();
+        _deferredDirty.erase(_deferredDirty.begin());
+        auto model = _deferredModels[id];
+        save(model.get());
+    }
+}
+
+void MailStore::_forgetDeferred(MailModel * model) {
+    if (_deferredModels.empty()) {
+        return;
+    }
+    _deferredModels.erase(model->id());
+    _deferredDirty.erase(model->id());
+}
+
 void MailStore::saveFolderStatus(Folder * folder, json & initialStatus) {
     json & changedStatus = folder->localStatus();
     if (changedStatus == initialStatus) {
@@ -426,16 +1588,71 @@ void MailStore::remove(MailModel * model) {
     query->bind(1, model->id());
     query->exec();
 
+    _forgetDeferred(model);
+
     model->afterRemove(this);
 
+    if (tableName == "Message") {
+        _didRemoveMessage((Message *)model);
+    }
+
     if (model->tableName() == "Label") {
-        globalLabelsVersion += 1;
+        _didChangeLabels();
     }
 
     DeltaStreamItem delta {DELTA_TYPE_UNPERSIST, model};
     _emit(delta);
 }
 
+CachedStatement MailStore::cachedStatement(const string & sql) {
+    auto existing = _findQueries.get(sql);
+    if (existing != nullptr) {
+        auto stmt = *existing;
+        if (_findQueriesCheckedOut.count(stmt.get())) {
+            // eg: a find inside a model hook while the caller is still stepping the
+            // same query. Resetting it here would silently end the caller's loop.
+            _findQueriesNested += 1;
+            return CachedStatement(nullptr, make_shared<SQLite::Statement>(this->_db, sql));
+        }
+        _findQueriesReused += 1;
+        stmt->clearBindings();
+        _findQueriesCheckedOut.insert(stmt.get());
+        return CachedStatement(this, stmt);
+    }
+    _findQueriesPrepared += 1;
+    auto stmt = make_shared<SQLite::Statement>(this->_db, sql);
+    _findQueries.put(sql, stmt);
+    _findQueriesCheckedOut.insert(stmt.get());
+    return CachedStatement(this, stmt);
+}
+
+CachedStatement::CachedStatement(MailStore * store, shared_ptr<SQLite::Statement> stmt) :
+    _store(store),
+    _stmt(stmt)
+{
+}
+
+CachedStatement::CachedStatement(CachedStatement && other) :
+    _store(other._store),
+    _stmt(std::move(other._stmt))
+{
+    other._store = nullptr;
+}
+
+CachedStatement::~CachedStatement() {
+    if (_stmt == nullptr) {
+        return;
+    }
+    try {
+        _stmt->reset();
+    } catch (SQLite::Exception &) {
+        // reset reports the error of the last step, which the caller has already seen
+    }
+    if (_store != nullptr) {
+        _store->_findQueriesCheckedOut.erase(_stmt.get());
+    }
+}
+
 void MailStore::_emit(DeltaStreamItem & delta) {
     if (_transactionOpen) {
         _transactionDeltas.push_back(delta);
@@ -525,4 +1742,355 @@ void MailStore::setStreamDelay(int streamMaxDelay) {
     _streamMaxDelay = streamMaxDelay;
 }
 
+/*
+ Runs a checkpoint of the given SQLITE_CHECKPOINT_* mode, waiting at most
+ busyTimeoutMs for readers and writers, and records its duration. Returns
+ true if the checkpoint ran to completion.
+ */
+bool MailStore::checkpoint(int mode, int busyTimeoutMs) {
+    auto start = chrono::steady_clock::now();
+    int logPages = 0;
+    int checkpointedPages = 0;
+
+    sqlite3 * handle = _db.getHandle();
+    sqlite3_busy_timeout(handle, busyTimeoutMs);
+    int rc = sqlite3_wal_checkpoint_v2(handle, nullptr, mode, &logPages, &checkpointedPages);
+    sqlite3_busy_timeout(handle, BUSY_TIMEOUT_MS);
+
+    long long ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    _checkpoints[mode] += 1;
+    _checkpointMs += ms;
+    _checkpointMsMax = max(_checkpointMsMax, ms);
+    if (rc == SQLITE_BUSY) {
+        _checkpointBusy += 1;
+    }
+    if (mode == SQLITE_CHECKPOINT_RESTART || mode == SQLITE_CHECKPOINT_TRUNCATE) {
+        if (rc == SQLITE_OK) {
+            _walPages = 0;
+        }
+    }
+    return rc == SQLITE_OK && logPages == checkpointedPages;
+}
+
+void MailStore::checkpointIdle() {
+    assertCorrectThread();
+    if (_walPages == 0) {
+        return;
+    }
+    if (checkpoint(SQLITE_CHECKPOINT_PASSIVE, 0)) {
+        checkpoint(SQLITE_CHECKPOINT_RESTART, 0);
+    }
+}
+
+/*
+ Resizes this connection's page cache if its share of the process-wide budget has
+ changed since it was last applied. Shrinking the cache frees pages immediately.
+ */
+void MailStore::applyMemoryBudget() {
+    int generation = MemoryBudget::generation();
+    if (generation == _memoryBudgetGeneration) {
+        return;
+    }
+    _memoryBudgetGeneration = generation;
+    // negative values are in KiB rather than pages
+    long long kb = MemoryBudget::connectionCacheSize() / 1024;
+    SQLite::Statement(_db, "PRAGMA main.cache_size = -" + to_string(kb)).exec();
+}
 
+void MailStore::didCommitToWAL(int pages) {
+    _walPages = pages;
+    _walPagesMax = max(_walPagesMax, pages);
+    auto now = chrono::steady_clock::now();
+    if (pages >= WAL_TRUNCATE_PAGES && (pages >= _truncateRetryPages || now >= _truncateRetryAt)) {
+        if (!checkpoint(SQLITE_CHECKPOINT_TRUNCATE, WAL_TRUNCATE_BUSY_TIMEOUT_MS)) {
+            _truncateRetryPages = pages + WAL_TRUNCATE_RETRY_PAGES;
+            _truncateRetryAt = now + chrono::seconds(WAL_TRUNCATE_RETRY_SECONDS);
+        }
+    } else if (pages >= WAL_PASSIVE_PAGES) {
+        checkpoint(SQLITE_CHECKPOINT_PASSIVE, 0);
+    }
+}
+
+void MailStore::logStats() {
+    long long total = _findQueriesPrepared + _findQueriesReused + _findQueriesNested;
+    if (total > 0) {
+        spdlog::get("logger")->info("Statement cache: {} lookups, {} prepared, {} reused ({}% hit rate), {} nested, {} cached.",
+            total, _findQueriesPrepared, _findQueriesReused, (_findQueriesReused * 100) / total, _findQueriesNested, _findQueries.size());
+    }
+    spdlog::get("logger")->info("Saves: {} skipped (unchanged), {} data-only updates.", _savesSkipped, _savesDataOnly);
+    for (auto & pair : _rowWrites) {
+        RowWriteStats & stats = pair.second;
+        if (stats.micros > 0) {
+            spdlog::get("logger")->info("Saves: {} {} rows written, {} timed in {}ms ({}/sec).",
+                stats.rows, stats.table, stats.timed, stats.micros / 1000, (stats.timed * 1000000) / stats.micros);
+        }
+    }
+    int cacheUsed = 0, cacheHits = 0, cacheMisses = 0, unused = 0;
+    sqlite3_db_status(_db.getHandle(), SQLITE_DBSTATUS_CACHE_USED, &cacheUsed, &unused, 0);
+    sqlite3_db_status(_db.getHandle(), SQLITE_DBSTATUS_CACHE_HIT, &cacheHits, &unused, 0);
+    sqlite3_db_status(_db.getHandle(), SQLITE_DBSTATUS_CACHE_MISS, &cacheMisses, &unused, 0);
+    if (cacheHits + cacheMisses > 0) {
+        spdlog::get("logger")->info("Page cache: {}KB used of {}KB, {} hits, {} misses ({}% hit rate).",
+            cacheUsed / 1024, MemoryBudget::connectionCacheSize() / 1024, cacheHits, cacheMisses,
+            ((long long)cacheHits * 100) / (cacheHits + cacheMisses));
+    }
+    spdlog::get("logger")->info("WAL: {} pages ({} max), checkpoints: {} passive, {} truncate, {} restart, {} busy, {}ms total, {}ms max.",
+        _walPages, _walPagesMax, _checkpoints[SQLITE_CHECKPOINT_PASSIVE], _checkpoints[SQLITE_CHECKPOINT_TRUNCATE],
+        _checkpoints[SQLITE_CHECKPOINT_RESTART], _checkpointBusy, _checkpointMs, _checkpointMsMax);
+}
+
+#pragma mark Search Indexes
+
+// FTS5 merge tuning. Writers merge a level of the index once it holds FTS_AUTOMERGE
+// segments, and always once it holds FTS_CRISISMERGE. Keeping FTS_AUTOMERGE high leaves
+// less merge work to sync, and maintainSearchIndexes merges the rest while idle in
+// steps of FTS_MERGE_STEP_PAGES. MAILSYNC_FTS_AUTOMERGE and MAILSYNC_FTS_CRISISMERGE
+// override the defaults.
+static vector<string> FTS_TABLES = {"ThreadSearch", "ContactSearch", "EventSearch"};
+static int FTS_AUTOMERGE = 8;
+static int FTS_CRISISMERGE = 16;
+static int FTS_MERGE_MIN_SEGMENTS = 4;
+static int FTS_MERGE_STEP_PAGES = 64;
+static int FTS_MERGE_MAX_STEPS = 32;
+static int FTS_MERGE_STEP_PAUSE_MS = 20;
+static string FTS_OPTIMIZE_TIME_KEY = "FTS_OPTIMIZE_TIME";
+static time_t FTS_OPTIMIZE_INTERVAL = 7 * 24 * 60 * 60; // 7 days
+
+// The id of the %_data row holding the FTS5 structure record
+#define FTS5_STRUCTURE_ROWID 10
+
+static int ftsConfigValue(string envKey, int defaultValue) {
+    string value = MailUtils::getEnvUTF8(envKey);
+    return value != "" ? stoi(value) : defaultValue;
+}
+
+/*
+ Returns the number of segments in an FTS5 index, read from its structure record:
+ a 4 byte cookie (preceded by a 4 byte version marker in newer releases), then
+ varints for the number of levels and the number of segments.
+ */
+static int ftsSegmentCount(SQLite::Database & db, const string & table) {
+    SQLite::Statement query(db, "SELECT block FROM `" + table + "_data` WHERE id = ?");
+    query.bind(1, FTS5_STRUCTURE_ROWID);
+    if (!query.executeStep()) {
+        return 0;
+    }
+    SQLite::Column block = query.getColumn(0);
+    const uint8_t * bytes = (const uint8_t *)block.getBlob();
+    int length = block.getBytes();
+
+    int ii = 4;
+    if (length >= 8 && bytes[0] == 0xFF && bytes[1] == 0 && bytes[2] == 0 && bytes[3] == 1) {
+        ii = 8;
+    }
+    uint32_t values[2] = {0, 0};
+    for (int v = 0; v < 2; v ++) {
+        while (ii < length) {
+            uint8_t byte = bytes[ii++];
+            values[v] = (values[v] << 7) | (byte & 0x7F);
+            if (!(byte & 0x80)) {
+                break;
+            }
+        }
+    }
+    return (int)values[1];
+}
+
+/*
+ Merges the segments of the FTS5 indexes in short write transactions, and
+ optimizes them (merging each into a single segment) every FTS_OPTIMIZE_INTERVAL.
+ The indexes get a steady stream of small writes, each of which adds a segment,
+ and queries slow down as segments accumulate. Call while the worker is idle.
+ */
+void MailStore::maintainSearchIndexes() {
+    assertCorrectThread();
+
+    // automerge and crisismerge are stored in the index, so they only need to be set once per launch
+    static std::once_flag configured;
+    std::call_once(configured, [&]() {
+        for (string table : FTS_TABLES) {
+            SQLite::Statement config(_db, "INSERT INTO `" + table + "` (`" + table + "`, rank) VALUES (?, ?)");
+            config.bind(1, "automerge");
+            config.bind(2, ftsConfigValue("MAILSYNC_FTS_AUTOMERGE", FTS_AUTOMERGE));
+            config.exec();
+            config.reset();
+            config.bind(1, "crisismerge");
+            config.bind(2, ftsConfigValue("MAILSYNC_FTS_CRISISMERGE", FTS_CRISISMERGE));
+            config.exec();
+        }
+    });
+
+    string optimizeTimeS = getKeyValue(FTS_OPTIMIZE_TIME_KEY);
+    time_t optimizeTime = optimizeTimeS != "" ? stol(optimizeTimeS) : 0;
+    bool optimize = time(0) - optimizeTime > FTS_OPTIMIZE_INTERVAL;
+    if (optimize) {
+        // Update the timer first so we don't re-attempt optimizing if it fails
+        saveKeyValue(FTS_OPTIMIZE_TIME_KEY, to_string(time(0)));
+    }
+
+    for (string table : FTS_TABLES) {
+        int initial = ftsSegmentCount(_db, table);
+        int steps = 0;
+        auto start = chrono::steady_clock::now();
+
+        if (optimize) {
+            SQLite::Statement(_db, "INSERT INTO `" + table + "` (`" + table + "`) VALUES ('optimize')").exec();
+        } else if (initial > FTS_MERGE_MIN_SEGMENTS) {
+            // a negative page count merges levels with fewer than automerge segments too.
+            // The index has been fully merged when a step makes fewer than two changes.
+            SQLite::Statement merge(_db, "INSERT INTO `" + table + "` (`" + table + "`, rank) VALUES ('merge', ?)");
+            merge.bind(1, -FTS_MERGE_STEP_PAGES);
+            while (steps < FTS_MERGE_MAX_STEPS) {
+                int changes = _db.getTotalChanges();
+                merge.exec();
+                merge.reset();
+                steps += 1;
+                if (_db.getTotalChanges() - changes < 2) {
+                    break;
+                }
+                std::this_thread::sleep_for(chrono::milliseconds(FTS_MERGE_STEP_PAUSE_MS));
+            }
+        }
+
+        int remaining = ftsSegmentCount(_db, table);
+        if (remaining != initial) {
+            auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+            spdlog::get("logger")->info("Search index {}: {} segments reduced to {} by {} in {}ms.",
+                table, initial, remaining, optimize ? "optimize" : to_string(steps) + " merge steps", ms);
+        }
+    }
+}
+
+/*
+ ThreadSearch is an external-content FTS5 table: it indexes ThreadSearchContent, but
+ reads it through ThreadSearchSource, which can't decompress bodies and shows FTS5 an
+ empty body for rows whose body is compressed. So FTS5 can't always find the text of
+ a row itself, and a row must be removed from the index with the 'delete' command and
+ exactly the text that was indexed before its content is changed or deleted. Callers
+ use loadThreadSearch to get that text.
+ */
+bool MailStore::loadThreadSearch(uint64_t rowid, ThreadSearchRow & row) {
+    auto query = cachedStatement("SELECT content_id, subject, to_, from_, categories, mailsync_body(body) FROM ThreadSearchContent WHERE id = ?");
+    query->bind(1, (long long)rowid);
+    bool found = query->executeStep();
+    if (found) {
+        row.contentId = query->getColumn(0).getString();
+        row.subject = query->getColumn(1).getString();
+        row.to = query->getColumn(2).getString();
+        row.from = query->getColumn(3).getString();
+        row.categories = query->getColumn(4).getString();
+        row.body = query->getColumn(5).getString();
+    }
+    query->reset();
+    return found;
+}
+
+static void bindThreadSearchIndex(SQLite::Statement & query, uint64_t rowid, const ThreadSearchRow & row) {
+    query.bind(1, (long long)rowid);
+    query.bind(2, row.contentId);
+    query.bind(3, row.subject);
+    query.bind(4, row.to);
+    query.bind(5, row.from);
+    query.bind(6, row.categories);
+    query.bind(7, row.body);
+}
+
+uint64_t MailStore::insertThreadSearch(const ThreadSearchRow & row) {
+    auto insert = cachedStatement("INSERT INTO ThreadSearchContent (content_id, subject, to_, from_, categories, body) VALUES (?, ?, ?, ?, ?, ?)");
+    insert->bind(1, row.contentId);
+    insert->bind(2, row.subject);
+    insert->bind(3, row.to);
+    insert->bind(4, row.from);
+    insert->bind(5, row.categories);
+    bindBody(*insert, 6, row.body);
+    insert->exec();
+    uint64_t rowid = _db.getLastInsertRowid();
+
+    auto index = cachedStatement("INSERT INTO ThreadSearch (rowid, content_id, subject, to_, from_, categories, body) VALUES (?, ?, ?, ?, ?, ?, ?)");
+    bindThreadSearchIndex(*index, rowid, row);
+    index->exec();
+    return rowid;
+}
+
+void MailStore::updateThreadSearch(uint64_t rowid, const ThreadSearchRow & indexed, const ThreadSearchRow & row) {
+    auto unindex = cachedStatement("INSERT INTO ThreadSearch (ThreadSearch, rowid, content_id, subject, to_, from_, categories, body) VALUES ('delete', ?, ?, ?, ?, ?, ?, ?)");
+    bindThreadSearchIndex(*unindex, rowid, indexed);
+    unindex->exec();
+
+    auto update = cachedStatement("UPDATE ThreadSearchContent SET content_id = ?, subject = ?, to_ = ?, from_ = ?, categories = ? WHERE id = ?");
+    update->bind(1, row.contentId);
+    update->bind(2, row.subject);
+    update->bind(3, row.to);
+    update->bind(4, row.from);
+    update->bind(5, row.categories);
+    update->bind(6, (long long)rowid);
+    update->exec();
+
+    // most updates only change the categories - don't recompress the body for them
+    if (row.body != indexed.body) {
+        auto updateBody = cachedStatement("UPDATE ThreadSearchContent SET body = ? WHERE id = ?");
+        bindBody(*updateBody, 1, row.body);
+        updateBody->bind(2, (long long)rowid);
+        updateBody->exec();
+    }
+
+    auto index = cachedStatement("INSERT INTO ThreadSearch (rowid, content_id, subject, to_, from_, categories, body) VALUES (?, ?, ?, ?, ?, ?, ?)");
+    bindThreadSearchIndex(*index, rowid, row);
+    index->exec();
+}
+
+/*
+ Updates only the categories of a ThreadSearch row. Nothing happens if they haven't
+ changed, which is the case for most thread saves (eg: read / unread). FTS5 can't
+ update one column of a row without re-tokenizing the others, but when the body is
+ stored as text, FTS5 can read the old text through ThreadSearchSource itself, so
+ we don't need to load the row or bind the body.
+ */
+void MailStore::updateThreadSearchCategories(uint64_t rowid, const string & categories) {
+    auto current = cachedStatement("SELECT categories, typeof(body) = 'blob' FROM ThreadSearchContent WHERE id = ?");
+    current->bind(1, (long long)rowid);
+    if (!current->executeStep()) {
+        return;
+    }
+    bool unchanged = current->getColumn(0).getString() == categories;
+    bool compressed = current->getColumn(1).getInt() != 0;
+    current->reset();
+    if (unchanged) {
+        return;
+    }
+
+    if (compressed) {
+        ThreadSearchRow indexed;
+        if (loadThreadSearch(rowid, indexed)) {
+            ThreadSearchRow row = indexed;
+            row.categories = categories;
+            updateThreadSearch(rowid, indexed, row);
+        }
+        return;
+    }
+
+    // the index must be updated first, while ThreadSearchSource still has the old text
+    auto index = cachedStatement("UPDATE ThreadSearch SET categories = ? WHERE rowid = ?");
+    index->bind(1, categories);
+    index->bind(2, (long long)rowid);
+    index->exec();
+
+    auto update = cachedStatement("UPDATE ThreadSearchContent SET categories = ? WHERE id = ?");
+    update->bind(1, categories);
+    update->bind(2, (long long)rowid);
+    update->exec();
+}
+
+void MailStore::removeThreadSearch(uint64_t rowid) {
+    ThreadSearchRow indexed;
+    if (!loadThreadSearch(rowid, indexed)) {
+        return;
+    }
+    auto unindex = cachedStatement("INSERT INTO ThreadSearch (ThreadSearch, rowid, content_id, subject, to_, from_, categories, body) VALUES ('delete', ?, ?, ?, ?, ?, ?, ?)");
+    bindThreadSearchIndex(*unindex, rowid, indexed);
+    unindex->exec();
+
+    auto remove = cachedStatement("DELETE FROM ThreadSearchContent WHERE id = ?");
+    remove->bind(1, (long long)rowid);
+    remove->exec();
+}
@@ -14,6 +14,9 @@
 
 #include <stdio.h>
 #include <vector>
+#include <set>
+#include <atomic>
+#include <chrono>
 
 #include <MailCore/MailCore.h>
 #include <SQLiteCpp/SQLiteCpp.h>
@@ -26,6 +29,10 @@
 #include "Query.hpp"
 #include "DeltaStream.hpp"
 #include "MailUtils.hpp"
+#include "LRUCache.hpp"
+#include "LabelSnapshot.hpp"
+#include "ValueSet.hpp"
+#include "UIDBitmap.hpp"
 
 using namespace nlohmann;
 using namespace std;
@@ -47,40 +54,217 @@ struct MessageAttributes {
     bool starred;
     bool draft;
     vector<string> labels;
+
+    // sorted LabelDictionary indexes of `labels`. Compared by MessageAttributesMatch
+    // and, for attributes read from the database, populated instead of `labels`.
+    vector<uint32_t> labelIds;
 };
 
 MessageAttributes MessageAttributesForMessage(mailcore::IMAPMessage * msg);
 bool MessageAttributesMatch(MessageAttributes a, MessageAttributes b);
 
+// LabelDictionary indexes start at 1. Labels looked up without being added to
+// the dictionary (see labelIdsForLabels) get this index, so they never match.
+#define LABEL_ID_UNKNOWN 0
+
+// Messages with higher remoteUIDs have been unlinked from their folder and are
+// waiting to be deleted. See MailProcessor::unlinkMessagesMatchingQuery.
+#define LOCAL_FOLDER_UID_MAX (UINT32_MAX - 5)
+
+// Unlinking more UIDs than this at once reloads the folder's LocalFolderUIDs
+// rather than removing them one by one. See MailStore::didUnlinkMessageUIDs.
+#define LOCAL_FOLDER_UID_CHANGES_MAX 5000
+
+/*
+ The UIDs of the messages in a folder and the attributes the sync worker compares
+ with the server (see MessageAttributesMatch), stored as UID bitmaps. One copy per
+ folder is shared by all workers and kept up to date as message saves and removals
+ are committed, so syncing a UID range doesn't need to read every message in it.
+ Shared copies are immutable - they're replaced rather than changed while in use.
+ */
+struct LocalFolderUIDs {
+    UIDBitmap uids;
+    UIDBitmap unread;
+    UIDBitmap starred;
+    map<vector<uint32_t>, UIDBitmap> byLabelIds;
+
+    void add(uint32_t uid, bool isUnread, bool isStarred, const vector<uint32_t> & labelIds);
+    void remove(uint32_t uid);
+    bool matches(const MessageAttributes & attrs) const;
+};
+
+// A change to a folder's LocalFolderUIDs made by a save or removal. Changes are
+// applied to the shared copy when the transaction that made them commits.
+struct LocalFolderUIDsChange {
+    string folderId;
+    uint32_t uid;
+    bool add;
+    bool unread;
+    bool starred;
+    vector<uint32_t> labelIds;
+};
+
+// The text indexed for a thread in ThreadSearch. See MailStore::updateThreadSearch.
+struct ThreadSearchRow {
+    string contentId;
+    string subject;
+    string to;
+    string from;
+    string categories;
+    string body;
+};
+
+class MailStore;
+
+/**
+ A statement checked out of MailStore's statement cache. It is reset when it goes
+ out of scope, including when an exception is thrown while it's being stepped, so
+ a cached statement never keeps a read snapshot open after its caller is done.
+ */
+class CachedStatement {
+    MailStore * _store;
+    shared_ptr<SQLite::Statement> _stmt;
+
+public:
+    CachedStatement(MailStore * store, shared_ptr<SQLite::Statement> stmt);
+    CachedStatement(CachedStatement && other);
+    CachedStatement(const CachedStatement &) = delete;
+    CachedStatement & operator=(const CachedStatement &) = delete;
+    ~CachedStatement();
+
+    SQLite::Statement * operator->() const {
+        return _stmt.get();
+    }
+    SQLite::Statement & operator*() const {
+        return *_stmt;
+    }
+};
+
 
 class MailStore {
+    friend class CachedStatement;
+
     SQLite::Database _db;
     SQLite::Statement _stmtBeginTransaction;
     SQLite::Statement _stmtRollbackTransaction;
     SQLite::Statement _stmtCommitTransaction;
     
     bool _transactionOpen;
+    unsigned long _transactionRollbacks;
     vector<DeltaStreamItem> _transactionDeltas;
 
+    // LocalFolderUIDs changes made in the open transaction, published when it commits.
+    vector<LocalFolderUIDsChange> _folderUIDChanges;
+    set<string> _folderUIDsInvalidated;
+
     map<string, shared_ptr<SQLite::Statement>> _saveUpdateQueries;
     map<string, shared_ptr<SQLite::Statement>> _saveInsertQueries;
     map<string, shared_ptr<SQLite::Statement>> _removeQueries;
+    map<string, shared_ptr<SQLite::Statement>> _saveDataQueries;
+    long long _savesSkipped;
+    long long _savesDataOnly;
+
+    // rows written by save(), by model schema. One in ROW_WRITE_SAMPLE_INTERVAL
+    // writes is timed (binding and executing) to estimate the write rate.
+    struct RowWriteStats {
+        string table;
+        long long rows = 0;
+        long long timed = 0;
+        long long micros = 0;
+    };
+    map<const ModelSchema *, RowWriteStats> _rowWrites;
+
+    // the MemoryBudget generation this connection's cache size was set for - see applyMemoryBudget()
+    int _memoryBudgetGeneration;
+
+    // WAL checkpoint stats - see checkpoint()
+    int _walPages;
+    int _walPagesMax;
+    map<int, long long> _checkpoints;
+    long long _checkpointBusy;
+    long long _checkpointMs;
+    long long _checkpointMsMax;
+
+    // after a TRUNCATE checkpoint fails, the next is attempted once the WAL
+    // reaches _truncateRetryPages or at _truncateRetryAt - see didCommitToWAL
+    int _truncateRetryPages;
+    chrono::steady_clock::time_point _truncateRetryAt;
+
+    // prepared SELECT statements used by the find* templates, keyed by SQL text
+    LRUCache<string, shared_ptr<SQLite::Statement>> _findQueries;
+    set<SQLite::Statement *> _findQueriesCheckedOut;
+    long long _findQueriesPrepared;
+    long long _findQueriesReused;
+    long long _findQueriesNested;
+
+    // models loaded for a deferred save within the open transaction, keyed by id.
+    // Dirty ones are written once when the transaction commits.
+    map<string, shared_ptr<MailModel>> _deferredModels;
+    set<string> _deferredDirty;
     
-    vector<shared_ptr<Label>> _labelCache;
-    int _labelCacheVersion;
+    // set when labels are saved or removed in the open transaction. This store
+    // uses a private label snapshot until the changes are committed and shared.
+    bool _labelsChanged;
+    shared_ptr<const LabelSnapshot> _privateLabelSnapshot;
+
+    // whether new MessageBody and ThreadSearchContent bodies are compressed, loaded
+    // from the _State table - see migrateBodyEncoding
+    bool _compressedBodies;
+
+    // LabelDictionary entries for _labelIdsAccountId, loaded on first use
+    map<string, uint32_t> _labelIds;
+    string _labelIdsAccountId;
     int _streamMaxDelay;
     size_t _owningThread;
     
 public:
+    bool compressedBodies();
+
+    void bindBody(SQLite::Statement & query, int index, const string & body);
+
+    // Set at launch when the account has its own database file - see moveAccountToDatabase.
+    static string accountDatabaseId;
+    static string databasePath();
+    static string databasePathForAccount(string accountId);
+    static bool accountDatabaseExists(string accountId);
+    static void removeAccountDatabase(string accountId);
+    static string accountDatabasesSQL(SQLite::Database & db, vector<string> accountIds);
+
     MailStore();
+    // Opens the database at `path` rather than databasePath()
+    MailStore(string path);
+    ~MailStore();
 
     void assertCorrectThread();
 
     void migrate();
+    void repairFolderBodyCounts();
+    bool convertToIncrementalVacuum();
+    long long vacuumIncrementally();
+    void maintainSearchIndexes();
+
+    bool loadThreadSearch(uint64_t rowid, ThreadSearchRow & row);
+    uint64_t insertThreadSearch(const ThreadSearchRow & row);
+    void updateThreadSearch(uint64_t rowid, const ThreadSearchRow & indexed, const ThreadSearchRow & row);
+    void updateThreadSearchCategories(uint64_t rowid, const string & categories);
+    void removeThreadSearch(uint64_t rowid);
+
+    bool checkpoint(int mode, int busyTimeoutMs);
+    void checkpointIdle();
+    void applyMemoryBudget();
+    void didCommitToWAL(int pages);
+
+    void migrateDataToJSON();
+    void migrateBodyEncoding(bool compressed);
 
     SQLite::Database & db();
 
     void resetForAccount(string accountId);
+
+    void moveAccountToDatabase(string accountId);
+    void attachAccountDatabases(vector<string> accountIds);
+    vector<string> accountDatabaseIds();
+    void saveAccountDatabases(vector<string> accountIds);
     
     string getKeyValue(string key);
     
@@ -90,21 +274,39 @@ public:
     
     void rollbackTransaction();
 
+    unsigned long transactionRollbacks();
+
     void unsafeEraseTransactionDeltas();
 
     void commitTransaction();
 
     void save(MailModel * model);
 
+    void saveDeferred(MailModel * model);
+
     void saveFolderStatus(Folder * folder, json & initialLocalStatus);
 
     uint32_t fetchMessageUIDAtDepth(Folder & folder, uint32_t depth, uint32_t before = UINT32_MAX);
 
-    map<uint32_t, MessageAttributes> fetchMessagesAttributesInRange(mailcore::Range range, Folder & folder);
+    shared_ptr<const LocalFolderUIDs> fetchLocalFolderUIDs(Folder & folder);
+
+    void invalidateLocalFolderUIDs(const string & folderId);
+
+    void didUnlinkMessageUIDs(const string & folderId, const vector<uint32_t> & uids);
+
+    shared_ptr<const LabelSnapshot> labelSnapshot(string accountId);
+
+    // Gmail label dictionary
+
+    vector<uint32_t> labelIdsForLabels(string accountId, const vector<string> & labels);
 
-    vector<shared_ptr<Label>> allLabelsCache(string accountId);
+    string packedLabelIdsForLabels(string accountId, const vector<string> & labels);
+
+    void migrateLabelIds();
 
     void setStreamDelay(int streamMaxDelay);
+
+    void logStats();
     
     // Detatched plugin metadata storage
     
@@ -112,6 +314,14 @@ public:
     
     void saveDetatchedPluginMetadata(Metadata & m);
 
+    /**
+     Returns a prepared statement for the given SQL from a small LRU cache, with
+     its bindings cleared. The statement is reset when the returned handle goes out
+     of scope. If the cached statement is still checked out further up the stack,
+     a separate statement is prepared rather than resetting the one in use.
+     */
+    CachedStatement cachedStatement(const string & sql);
+
     // Find - Not templated
 
     shared_ptr<MailModel> findGeneric(string type, Query query);
@@ -123,49 +333,76 @@ public:
     template<typename ModelClass>
     shared_ptr<ModelClass> find(Query & query) {
         assertCorrectThread();
-        SQLite::Statement statement(this->_db, "SELECT data FROM " + ModelClass::TABLE_NAME + query.getSQL() + " LIMIT 1");
-        query.bind(statement);
-        if (statement.executeStep()) {
-            return make_shared<ModelClass>(statement);
+        auto statement = cachedStatement("SELECT id, accountId, data FROM " + ModelClass::TABLE_NAME + query.getSQL() + " LIMIT 1");
+        query.bind(*statement);
+
+        shared_ptr<ModelClass> result = nullptr;
+        if (statement->executeStep()) {
+            result = make_shared<ModelClass>(*statement);
+            _substituteDeferred(result);
         }
-        return nullptr;
+        statement->reset();
+        return result;
+    }
+
+    /**
+     Returns the model with the given ID and keeps it in memory until the open
+     transaction ends. Changes should be applied to it and saved with saveDeferred,
+     which writes it once at commit no matter how many times it was modified. While
+     the transaction is open, the find* methods return this instance rather than
+     re-reading the (stale) row.
+     */
+    template<typename ModelClass>
+    shared_ptr<ModelClass> findForDeferredSave(string id) {
+        auto model = find<ModelClass>(Query().equal("id", id));
+        if (model != nullptr && _transactionOpen) {
+            _deferredModels[id] = model;
+        }
+        return model;
+    }
+
+    /**
+     Returns the instance held for a deferred save in the open transaction, or
+     nullptr. Never reads the database.
+     */
+    template<typename ModelClass>
+    shared_ptr<ModelClass> findDeferred(const string & id) {
+        auto it = _deferredModels.find(id);
+        if (it == _deferredModels.end()) {
+            return nullptr;
+        }
+        return dynamic_pointer_cast<ModelClass>(it->second);
     }
     
     template<typename ModelClass>
     vector<shared_ptr<ModelClass>> findAll(Query & query) {
         assertCorrectThread();
-        string sql = "SELECT data FROM " + ModelClass::TABLE_NAME + query.getSQL();
+        string sql = "SELECT id, accountId, data FROM " + ModelClass::TABLE_NAME + query.getSQL();
         if (query.getLimit() != 0) {
             sql = sql + " LIMIT " + to_string(query.getLimit());
         }
-        SQLite::Statement statement(this->_db, sql);
-        query.bind(statement);
+        auto statement = cachedStatement(sql);
+        query.bind(*statement);
         
         vector<shared_ptr<ModelClass>> results;
-        while (statement.executeStep()) {
-            results.push_back(make_shared<ModelClass>(statement));
+        while (statement->executeStep()) {
+            auto model = make_shared<ModelClass>(*statement);
+            _substituteDeferred(model);
+            results.push_back(model);
         }
+        statement->reset();
         
         return results;
     }
     
     
     /**
-     Handles dividing a large set into small chunks of <1000 and re-aggregating the results so SQLite can handle it.
+     Finds the models whose `colname` is in the set. The set is bound as a single
+     parameter (see ValueSet), so a set of any size is one query.
      */
     template<typename ModelClass>
     vector<shared_ptr<ModelClass>> findLargeSet(std::string colname, vector<std::string> & set) {
-        assertCorrectThread();
-        
-        vector<shared_ptr<ModelClass>> all;
-
-        auto chunks = MailUtils::chunksOfVector(set, 900);
-        for (auto chunk : chunks) {
-            auto results = this->findAll<ModelClass>(Query().equal(colname, chunk));
-            all.insert(all.end(), results.begin(), results.end());
-        }
-        
-        return all;
+        return this->findAll<ModelClass>(Query().equal(colname, set));
     }
     
     
@@ -173,13 +410,16 @@ public:
     template<typename ModelClass>
     map<string, shared_ptr<ModelClass>> findAllMap(Query & query, std::string keyField) {
         assertCorrectThread();
-        SQLite::Statement statement(this->_db, "SELECT " + keyField + ", data FROM " + ModelClass::TABLE_NAME + query.getSQL());
-        query.bind(statement);
+        auto statement = cachedStatement("SELECT " + keyField + ", id, accountId, data FROM " + ModelClass::TABLE_NAME + query.getSQL());
+        query.bind(*statement);
 
         map<string, shared_ptr<ModelClass>> results;
-        while (statement.executeStep()) {
-            results[statement.getColumn(keyField.c_str()).getString()] = make_shared<ModelClass>(statement);
+        while (statement->executeStep()) {
+            auto model = make_shared<ModelClass>(*statement);
+            _substituteDeferred(model);
+            results[statement->getColumn(keyField.c_str()).getString()] = model;
         }
+        statement->reset();
         
         return results;
     }
@@ -187,23 +427,67 @@ public:
     template<typename ModelClass>
     map<uint32_t, shared_ptr<ModelClass>> findAllUINTMap(Query & query, std::string keyField) {
         assertCorrectThread();
-        SQLite::Statement statement(this->_db, "SELECT " + keyField + ", data FROM " + ModelClass::TABLE_NAME + query.getSQL());
-        query.bind(statement);
+        auto statement = cachedStatement("SELECT " + keyField + ", id, accountId, data FROM " + ModelClass::TABLE_NAME + query.getSQL());
+        query.bind(*statement);
 
         map<uint32_t, shared_ptr<ModelClass>> results;
-        while (statement.executeStep()) {
-            results[statement.getColumn(keyField.c_str()).getUInt()] = make_shared<ModelClass>(statement);
+        while (statement->executeStep()) {
+            auto model = make_shared<ModelClass>(*statement);
+            _substituteDeferred(model);
+            results[statement->getColumn(keyField.c_str()).getUInt()] = model;
         }
+        statement->reset();
         
         return results;
     }
     
     void remove(MailModel * model);
+
+    /**
+     Removes many models at once. The rows are deleted with a few set-based
+     statements, each model's afterRemove hook runs (so counters on related
+     models are updated - threads are saved once at commit), and a single
+     unpersist delta is emitted for the set.
+     */
+    template<typename ModelClass>
+    void removeAll(vector<shared_ptr<ModelClass>> & models) {
+        assertCorrectThread();
+        if (models.size() == 0) {
+            return;
+        }
+
+        vector<string> ids{};
+        for (auto & model : models) {
+            ids.push_back(model->id());
+        }
+        auto statement = cachedStatement("DELETE FROM " + ModelClass::TABLE_NAME + " WHERE id IN (" VALUE_SET_SELECT ")");
+        ValueSet(ids).bind(*statement, 1);
+        statement->exec();
+
+        vector<shared_ptr<MailModel>> removed{};
+        for (auto & model : models) {
+            _forgetDeferred(model.get());
+            model->afterRemove(this);
+            if (auto message = dynamic_cast<Message *>(model.get())) {
+                _didRemoveMessage(message);
+            }
+            removed.push_back(model);
+        }
+
+        DeltaStreamItem delta {DELTA_TYPE_UNPERSIST, removed};
+        _emit(delta);
+    }
     
     template<typename ModelClass>
     void remove(Query & query) {
         assertCorrectThread();
         auto models = findAll<ModelClass>(query);
+        for (auto & model : models) {
+            _forgetDeferred(model.get());
+            if (auto message = dynamic_cast<Message *>(model.get())) {
+                _didRemoveMessage(message);
+            }
+        }
 
         SQLite::Statement statement(this->_db, "DELETE FROM " + ModelClass::TABLE_NAME + query.getSQL());
         query.bind(statement);
@@ -216,6 +500,37 @@ public:
 
 private:
 
+    template<typename ModelClass>
+    void _substituteDeferred(shared_ptr<ModelClass> & model) {
+        if (_deferredModels.empty()) {
+            return;
+        }
+        auto it = _deferredModels.find(model->id());
+        if (it == _deferredModels.end()) {
+            return;
+        }
+        auto existing = dynamic_pointer_cast<ModelClass>(it->second);
+        if (existing != nullptr) {
+            model = existing;
+        }
+    }
+
+    void _forgetDeferred(MailModel * model);
+
+    uint32_t _labelIdFor(string accountId, const string & label, bool assign);
+
+    void _flushDeferredSaves();
+
+    void _didChangeLabels();
+
+    void _didSaveMessage(Message * message, const json & previous);
+
+    void _didRemoveMessage(Message * message);
+
+    void _recordFolderUIDsChange(LocalFolderUIDsChange change);
+
+    void _publishFolderUIDsChanges();
+
     void _emit(DeltaStreamItem & delta);
 };
 
@@ -378,40 +378,6 @@ string MailUtils::pathForFile(string root, File * file, bool create) {
     return path;
 }
 
-shared_ptr<Label> MailUtils::labelForXGMLabelName(string mlname, vector<shared_ptr<Label>> allLabels) {
-    for (const auto & label : allLabels) {
-        if (label->path() == mlname) {
-            return label;
-        }
-    }
-    
-    // \\Inbox should match INBOX
-    if (mlname.substr(0, 1) == "\\") {
-        mlname = mlname.substr(1, mlname.length() - 1);
-        transform(mlname.begin(), mlname.end(), mlname.begin(), ::tolower);
-
-        for (const auto & label : allLabels) {
-            string path(label->path());
-            transform(path.begin(), path.end(), path.begin(), ::tolower);
-            if (path.substr(0, 8) == "[gmail]/") {
-                path = path.substr(8, path.length() - 8);
-            }
-                
-            if (path == mlname) {
-                return label;
-            }
-            
-            // sent => [Gmail]/Sent Mail (sent), draft => [Gmail]/Drafts (drafts)
-            if ((label->role() == mlname) || (label->role() == mlname + "s")) {
-                return label;
-            }
-        }
-    }
-
-    cout << "\n\nIMPORTANT --- Label not found: " << mlname;
-    return shared_ptr<Label>{};
-}
-
 vector<Query> MailUtils::queriesForUIDRangesInIndexSet(string remoteFolderId, IndexSet * set) {
     vector<Query> results {};
     vector<uint32_t> uids {};
@@ -438,9 +404,9 @@ vector<Query> MailUtils::queriesForUIDRangesInIndexSet(string remoteFolderId, In
             results.push_back(Query().equal("remoteFolderId", remoteFolderId).gte("remoteUID", left));
         } else if (right - left > 50) {
             // this range has many items, just express it as a bounded range query
-            results.push_back(Query().equal("remoteFolderId", remoteFolderId).gte("remoteUID", left).lt("remoteUID", right));
+            results.push_back(Query().equal("remoteFolderId", remoteFolderId).gte("remoteUID", left).lte("remoteUID", right));
         } else {
-            // this range has a few items, throw them in a pile and we'll make a few queries for these specific UIDs
+            // this range has a few items, throw them in a pile and query these specific UIDs together
             for (uint64_t x = left; x <= right; x ++) {
                 uids.push_back((uint32_t)x);
             }
@@ -448,9 +414,7 @@ vector<Query> MailUtils::queriesForUIDRangesInIndexSet(string remoteFolderId, In
     }
 
     if (uids.size() > 0) {
-        for (vector<uint32_t> chunk : MailUtils::chunksOfVector(uids, 200)) {
-            results.push_back(Query().equal("remoteFolderId", remoteFolderId).equal("remoteUID", chunk));
-        }
+        results.push_back(Query().equal("remoteFolderId", remoteFolderId).equal("remoteUID", uids));
     }
 
     return results;
@@ -73,8 +73,6 @@ public:
     static string idForFile(Message * message, Attachment * attachment);
     static string idForDraftHeaderMessageId(string accountId, string headerMessageId);
     
-    static shared_ptr<Label> labelForXGMLabelName(string mlname, vector<shared_ptr<Label>> allLabels);
-
     static string qmarks(size_t count);
     static string qmarkSets(size_t count, size_t perSet);
 
@@ -0,0 +1,181 @@
+//
+//  MemoryBudget.cpp
+//  MailSync
+//
+//  Created by agent on 10/17/26.
+//  Copyright © 2026 Foundry 376. All rights reserved.
+//
+//  Use of this file is subject to the terms and conditions defined
+//  in 'LICENSE.md', which is part of the Mailspring-Sync package.
+//
+
+#include "MemoryBudget.hpp"
+#include "MailUtils.hpp"
+
+#include <sqlite3.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <algorithm>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <sys/sysctl.h>
+#include <mach/mach.h>
+#else
+#include <fstream>
+#endif
+
+#include "spdlog/spdlog.h"
+
+#define MB (1024LL * 1024LL)
+
+// Budget tuning. See MemoryBudget.hpp.
+static int64_t MEMORY_BUDGET_RAM_DIVISOR = 64;
+static int64_t MEMORY_BUDGET_MIN = 64 * MB;
+static int64_t MEMORY_BUDGET_MAX = 512 * MB;
+// statements, schemas and lookaside memory on top of the page caches
+static int64_t MEMORY_BUDGET_HEAP_HEADROOM = 32 * MB;
+// the system is under pressure when less than this share of memory is available
+static uint64_t MEMORY_PRESSURE_AVAILABLE_PERCENT = 10;
+
+static std::once_flag configured;
+static int64_t cacheBudget = 0;
+static int64_t mmapBytes = 0;
+static uint64_t systemTotal = 0;
+
+static std::atomic<int> connections {0};
+static std::atomic<int> connectionsMax {0};
+static std::atomic<int> budgetGeneration {1};
+static std::atomic<bool> underPressure {false};
+static std::atomic<long long> pressureEvents {0};
+
+static int64_t envMegabytes(string key, int64_t defaultValue) {
+    string value = MailUtils::getEnvUTF8(key);
+    return value != "" ? stoll(value) * MB : defaultValue;
+}
+
+static int64_t softHeapLimit() {
+    int64_t budget = underPressure ? cacheBudget / MEMORY_PRESSURE_CACHE_DIVISOR : cacheBudget;
+    return budget + MEMORY_BUDGET_HEAP_HEADROOM;
+}
+
+static void configure() {
+    std::call_once(configured, []() {
+        uint64_t available = 0;
+        MemoryBudget::systemMemory(systemTotal, available);
+
+        int64_t fromSystem = min(MEMORY_BUDGET_MAX, max(MEMORY_BUDGET_MIN, (int64_t)(systemTotal / MEMORY_BUDGET_RAM_DIVISOR)));
+        cacheBudget = envMegabytes("MAILSYNC_CACHE_BUDGET_MB", fromSystem);
+        mmapBytes = envMegabytes("MAILSYNC_MMAP_SIZE_MB", 0);
+        sqlite3_soft_heap_limit64(softHeapLimit());
+    });
+}
+
+bool MemoryBudget::systemMemory(uint64_t & total, uint64_t & available) {
+#if defined(_WIN32)
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    if (!GlobalMemoryStatusEx(&status)) {
+        return false;
+    }
+    total = status.ullTotalPhys;
+    available = status.ullAvailPhys;
+    return true;
+#elif defined(__APPLE__)
+    size_t size = sizeof(total);
+    if (sysctlbyname("hw.memsize", &total, &size, NULL, 0) != 0) {
+        return false;
+    }
+    vm_statistics64_data_t vm;
+    mach_msg_type_number_t count = HOST_VM_INFO64_COUNT;
+    if (host_statistics64(mach_host_self(), HOST_VM_INFO64, (host_info64_t)&vm, &count) != KERN_SUCCESS) {
+        return false;
+    }
+    // inactive pages are reclaimed before anything is swapped out
+    available = ((uint64_t)vm.free_count + vm.inactive_count) * vm_page_size;
+    return true;
+#else
+    std::ifstream meminfo("/proc/meminfo");
+    string key;
+    uint64_t kb = 0;
+    string unit;
+    total = 0;
+    available = 0;
+    while (meminfo >> key >> kb >> unit) {
+        if (key == "MemTotal:") {
+            total = kb * 1024;
+        } else if (key == "MemAvailable:") {
+            available = kb * 1024;
+        }
+    }
+    return total > 0 && available > 0;
+#endif
+}
+
+void MemoryBudget::connectionOpened() {
+    configure();
+    int count = ++connections;
+    connectionsMax = max(connectionsMax.load(), count);
+    if (count > MEMORY_BUDGET_MIN_CONNECTIONS) {
+        budgetGeneration += 1;
+    }
+}
+
+void MemoryBudget::connectionClosed() {
+    int count = connections--;
+    if (count > MEMORY_BUDGET_MIN_CONNECTIONS) {
+        budgetGeneration += 1;
+    }
+}
+
+int MemoryBudget::generation() {
+    return budgetGeneration;
+}
+
+int64_t MemoryBudget::connectionCacheSize() {
+    configure();
+    int64_t share = cacheBudget / max(connections.load(), MEMORY_BUDGET_MIN_CONNECTIONS);
+    return underPressure ? share / MEMORY_PRESSURE_CACHE_DIVISOR : share;
+}
+
+int64_t MemoryBudget::mmapSize() {
+    configure();
+    return mmapBytes;
+}
+
+/*
+ Compares available system memory to MEMORY_PRESSURE_AVAILABLE_PERCENT and shrinks or
+ restores the budget when the answer changes. Returns true while under pressure.
+ */
+bool MemoryBudget::checkMemoryPressure() {
+    configure();
+    uint64_t total = 0;
+    uint64_t available = 0;
+    if (!systemMemory(total, available)) {
+        return underPressure;
+    }
+    bool pressure = available * 100 < total * MEMORY_PRESSURE_AVAILABLE_PERCENT;
+    if (pressure != underPressure.exchange(pressure)) {
+        if (pressure) {
+            pressureEvents += 1;
+        }
+        sqlite3_soft_heap_limit64(softHeapLimit());
+        budgetGeneration += 1;
+        spdlog::get("logger")->info("Memory budget: {} memory pressure ({}MB of {}MB available), SQLite heap limit now {}MB.",
+            pressure ? "entering" : "leaving", available / MB, total / MB, softHeapLimit() / MB);
+    }
+    return pressure;
+}
+
+void MemoryBudget::logStats() {
+    configure();
+    sqlite3_int64 used = 0;
+    sqlite3_int64 usedMax = 0;
+    sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &used, &usedMax, 0);
+    spdlog::get("logger")->info("Memory budget: {}MB page cache for {} connections ({} max), {}KB each, mmap {}MB. "
+        "SQLite heap {}MB ({}MB max) of {}MB limit, {} pressure events, {}MB system memory.",
+        cacheBudget / MB, connections.load(), connectionsMax.load(), connectionCacheSize() / 1024, mmapBytes / MB,
+        used / MB, usedMax / MB, softHeapLimit() / MB, pressureEvents.load(), systemTotal / MB);
+}
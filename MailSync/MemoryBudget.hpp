@@ -0,0 +1,54 @@
+//
+//  MemoryBudget.hpp
+//  MailSync
+//
+//  Created by agent on 10/17/26.
+//  Copyright © 2026 Foundry 376. All rights reserved.
+//
+//  Use of this file is subject to the terms and conditions defined
+//  in 'LICENSE.md', which is part of the Mailspring-Sync package.
+//
+
+#ifndef MemoryBudget_hpp
+#define MemoryBudget_hpp
+
+#include <stdio.h>
+#include <stdint.h>
+
+using namespace std;
+
+/*
+ The process-wide memory budget for SQLite. The page cache budget is split evenly
+ between the open MailStore connections (counting at least MEMORY_BUDGET_MIN_CONNECTIONS,
+ so the first connections don't take all of it), and SQLite's soft heap limit is set
+ just above it so the total holds even when connections come and go.
+
+ When the system is low on memory the connections' shares are divided by
+ MEMORY_PRESSURE_CACHE_DIVISOR and the soft heap limit is lowered to match. Each
+ connection applies a changed share itself - see MailStore::applyMemoryBudget.
+
+ The budget defaults to 1/64th of physical memory within [64MB, 512MB], and can be
+ set with MAILSYNC_CACHE_BUDGET_MB. Memory-mapped I/O is off unless MAILSYNC_MMAP_SIZE_MB
+ is set. Mapped pages belong to the OS page cache and don't count against the budget.
+ */
+#define MEMORY_BUDGET_MIN_CONNECTIONS   6
+#define MEMORY_PRESSURE_CACHE_DIVISOR   4
+
+class MemoryBudget {
+public:
+    static bool systemMemory(uint64_t & total, uint64_t & available);
+
+    static void connectionOpened();
+    static void connectionClosed();
+
+    // changes whenever connectionCacheSize does
+    static int generation();
+    static int64_t connectionCacheSize();
+    static int64_t mmapSize();
+
+    static bool checkMemoryPressure();
+
+    static void logStats();
+};
+
+#endif /* MemoryBudget_hpp */
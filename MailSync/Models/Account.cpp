@@ -155,9 +155,9 @@ string Account::tableName(){
     return "";
 }
 
-vector<string> Account::columnsForQuery() {
+const ModelSchema & Account::schema() {
     assert(false);
-    return {};
+    return MailModel::SCHEMA;
 }
 
 void Account::bindToQuery(SQLite::Statement * query) {
@@ -57,7 +57,7 @@ public:
     string tableName();
     string constructorName();
 
-    vector<string> columnsForQuery();
+    const ModelSchema & schema();
     void bindToQuery(SQLite::Statement * query);
 };
 
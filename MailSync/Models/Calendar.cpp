@@ -16,6 +16,7 @@
 using namespace std;
 
 string Calendar::TABLE_NAME = "Calendar";
+ModelSchema Calendar::SCHEMA {{"id", "data", "accountId"}};
 
 Calendar::Calendar(json & json) : MailModel(json) {
     
@@ -52,12 +53,14 @@ string Calendar::tableName() {
     return Calendar::TABLE_NAME;
 }
 
-vector<string> Calendar::columnsForQuery() {
-    return vector<string>{"id", "data", "accountId"};
+const ModelSchema & Calendar::schema() {
+    return Calendar::SCHEMA;
 }
 
 void Calendar::bindToQuery(SQLite::Statement * query) {
-    query->bind(":id", id());
-    query->bind(":data", toJSON().dump());
-    query->bind(":accountId", accountId());
+    query->bind(1, id());
+    bindDataToQuery(query, 2);
+    ModelSchemaBinder(query, SCHEMA, 3)
+        .bind("accountId", accountId())
+        .finish();
 }
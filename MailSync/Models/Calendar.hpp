@@ -25,6 +25,7 @@ class Calendar : public MailModel {
     
 public:
     static string TABLE_NAME;
+    static ModelSchema SCHEMA;
 
     Calendar(json & json);
     Calendar(string id, string accountId);
@@ -37,7 +38,7 @@ public:
     void setName(string name);
 
     string tableName();
-    vector<string> columnsForQuery();
+    const ModelSchema & schema();
     void bindToQuery(SQLite::Statement * query);
 };
 
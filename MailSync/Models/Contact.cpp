@@ -18,6 +18,7 @@ using namespace std;
 using namespace mailcore;
 
 string Contact::TABLE_NAME = "Contact";
+ModelSchema Contact::SCHEMA {{"id", "data", "accountId", "version", "refs", "email", "hidden", "source", "etag", "bookId"}};
 
 Contact::Contact(string id, string accountId, string email, int refs, string source) : MailModel(id, accountId) {
     _data["email"] = email;
@@ -156,18 +157,20 @@ void Contact::mutateCardInInfo(function<void(shared_ptr<VCard>)> yieldBlock) {
     setInfo(nextInfo);
 }
 
-vector<string> Contact::columnsForQuery() {
-    return vector<string>{"id", "data", "accountId", "version", "refs", "email", "hidden", "source", "etag", "bookId" };
+const ModelSchema & Contact::schema() {
+    return Contact::SCHEMA;
 }
 
 void Contact::bindToQuery(SQLite::Statement * query) {
     MailModel::bindToQuery(query);
-    query->bind(":refs", refs());
-    query->bind(":email", email());
-    query->bind(":hidden", hidden() ? 1 : 0);
-    query->bind(":source", source());
-    query->bind(":etag", etag());
-    query->bind(":bookId", bookId());
+    ModelSchemaBinder(query, SCHEMA, MODEL_COLUMN_VERSION + 1)
+        .bind("refs", refs())
+        .bind("email", email())
+        .bind("hidden", hidden() ? 1 : 0)
+        .bind("source", source())
+        .bind("etag", etag())
+        .bind("bookId", bookId())
+        .finish();
 }
 
 
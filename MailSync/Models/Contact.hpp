@@ -36,6 +36,7 @@ class Contact : public MailModel {
     
 public:
     static string TABLE_NAME;
+    static ModelSchema SCHEMA;
 
     Contact(string id, string accountId, string email, int refs, string source);
     Contact(json json);
@@ -69,7 +70,7 @@ public:
     string tableName();
     string constructorName();
 
-    vector<string> columnsForQuery();
+    const ModelSchema & schema();
     void bindToQuery(SQLite::Statement * query);
     
     void afterSave(MailStore * store);
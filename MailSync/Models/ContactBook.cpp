@@ -18,6 +18,7 @@ using namespace std;
 using namespace mailcore;
 
 string ContactBook::TABLE_NAME = "ContactBook";
+ModelSchema ContactBook::SCHEMA {{"id", "data", "accountId", "version"}};
 
 ContactBook::ContactBook(string id, string accountId) :
     MailModel(id, accountId)
@@ -55,11 +56,12 @@ void ContactBook::setSource(string source) {
     _data["source"] = source;
 }
 
-vector<string> ContactBook::columnsForQuery() {
-    return vector<string>{"id", "accountId", "version", "data"};
+const ModelSchema & ContactBook::schema() {
+    return ContactBook::SCHEMA;
 }
 
 void ContactBook::bindToQuery(SQLite::Statement * query) {
     MailModel::bindToQuery(query);
+    ModelSchemaBinder(query, SCHEMA, MODEL_COLUMN_VERSION + 1).finish();
 }
 
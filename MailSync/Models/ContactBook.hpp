@@ -30,6 +30,7 @@ class ContactBook : public MailModel {
     
 public:
     static string TABLE_NAME;
+    static ModelSchema SCHEMA;
 
     ContactBook(string id, string accountId);
     ContactBook(SQLite::Statement & query);
@@ -42,7 +43,7 @@ public:
     string tableName();
     string constructorName();
 
-    vector<string> columnsForQuery();
+    const ModelSchema & schema();
     void bindToQuery(SQLite::Statement * query);
 };
 
@@ -18,6 +18,7 @@ using namespace std;
 using namespace mailcore;
 
 string ContactGroup::TABLE_NAME = "ContactGroup";
+ModelSchema ContactGroup::SCHEMA {{"id", "data", "accountId", "version", "name", "bookId"}};
 
 ContactGroup::ContactGroup(string id, string accountId) :
     MailModel(id, accountId)
@@ -61,14 +62,16 @@ void ContactGroup::setGoogleResourceName(string rn) {
     _data["grn"] = rn;
 }
 
-vector<string> ContactGroup::columnsForQuery() {
-    return vector<string>{"id", "accountId", "version", "data", "name", "bookId"};
+const ModelSchema & ContactGroup::schema() {
+    return ContactGroup::SCHEMA;
 }
 
 void ContactGroup::bindToQuery(SQLite::Statement * query) {
     MailModel::bindToQuery(query);
-    query->bind(":name", name());
-    query->bind(":bookId", bookId());
+    ModelSchemaBinder(query, SCHEMA, MODEL_COLUMN_VERSION + 1)
+        .bind("name", name())
+        .bind("bookId", bookId())
+        .finish();
 }
 
 
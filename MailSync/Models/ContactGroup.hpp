@@ -30,6 +30,7 @@ class ContactGroup : public MailModel {
     
 public:
     static string TABLE_NAME;
+    static ModelSchema SCHEMA;
 
     ContactGroup(string id, string accountId);
     ContactGroup(SQLite::Statement & query);
@@ -44,7 +45,7 @@ public:
     string tableName();
     string constructorName();
 
-    vector<string> columnsForQuery();
+    const ModelSchema & schema();
     void bindToQuery(SQLite::Statement * query);
     
     void afterRemove(MailStore * store);
@@ -19,6 +19,7 @@ using namespace std;
 using namespace mailcore;
 
 string Event::TABLE_NAME = "Event";
+ModelSchema Event::SCHEMA {{"id", "data", "icsuid", "accountId", "etag", "calendarId", "recurrenceStart", "recurrenceEnd"}};
 
 static Date DISTANT_FUTURE;
 
@@ -87,17 +88,19 @@ int Event::recurrenceEnd() {
     return _data["re"].get<int>();
 }
 
-vector<string> Event::columnsForQuery() {
-    return vector<string>{"id", "data", "icsuid", "accountId", "etag", "calendarId", "recurrenceStart", "recurrenceEnd"};
+const ModelSchema & Event::schema() {
+    return Event::SCHEMA;
 }
 
 void Event::bindToQuery(SQLite::Statement * query) {
-    query->bind(":id", id());
-    query->bind(":data", this->toJSON().dump());
-    query->bind(":icsuid", icsUID());
-    query->bind(":accountId", accountId());
-    query->bind(":etag", etag());
-    query->bind(":calendarId", calendarId());
-    query->bind(":recurrenceStart", recurrenceStart());
-    query->bind(":recurrenceEnd", recurrenceEnd());
+    query->bind(1, id());
+    bindDataToQuery(query, 2);
+    ModelSchemaBinder(query, SCHEMA, 3)
+        .bind("icsuid", icsUID())
+        .bind("accountId", accountId())
+        .bind("etag", etag())
+        .bind("calendarId", calendarId())
+        .bind("recurrenceStart", recurrenceStart())
+        .bind("recurrenceEnd", recurrenceEnd())
+        .finish();
 }
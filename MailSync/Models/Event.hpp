@@ -30,6 +30,7 @@ class Event : public MailModel {
     
 public:
     static string TABLE_NAME;
+    static ModelSchema SCHEMA;
 
 Event(string etag, string accountId, string calendarId, string ics, ICalendarEvent * event);
     Event(SQLite::Statement & query);
@@ -45,7 +46,7 @@ Event(string etag, string accountId, string calendarId, string ics, ICalendarEve
     string tableName();
     string constructorName();
 
-    vector<string> columnsForQuery();
+    const ModelSchema & schema();
     void bindToQuery(SQLite::Statement * query);
 };
 
@@ -19,6 +19,7 @@ using namespace std;
 using namespace mailcore;
 
 string File::TABLE_NAME = "File";
+ModelSchema File::SCHEMA {{"id", "data", "accountId", "version", "filename"}};
 
 File::File(Message * msg, Attachment * a) :
     MailModel(MailUtils::idForFile(msg, a), msg->accountId(), 0)
@@ -110,11 +111,13 @@ string File::contentType() {
     return _data["contentType"].get<string>();
 }
 
-vector<string> File::columnsForQuery() {
-    return vector<string>{"id", "data", "accountId", "version", "filename"};
+const ModelSchema & File::schema() {
+    return File::SCHEMA;
 }
 
 void File::bindToQuery(SQLite::Statement * query) {
     MailModel::bindToQuery(query);
-    query->bind(":filename", filename());
+    ModelSchemaBinder(query, SCHEMA, MODEL_COLUMN_VERSION + 1)
+        .bind("filename", filename())
+        .finish();
 }
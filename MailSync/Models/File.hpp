@@ -31,6 +31,7 @@ class File : public MailModel {
     
 public:
     static string TABLE_NAME;
+    static ModelSchema SCHEMA;
 
     File(Message * msg, Attachment * a);
     File(json json);
@@ -46,7 +47,7 @@ public:
     string tableName();
     string constructorName();
 
-    vector<string> columnsForQuery();
+    const ModelSchema & schema();
     void bindToQuery(SQLite::Statement * query);
 };
 
@@ -16,6 +16,7 @@
 using namespace std;
 
 string Folder::TABLE_NAME = "Folder";
+ModelSchema Folder::SCHEMA {{"id", "data", "accountId", "version", "path", "role"}};
 
 Folder::Folder(json & json) : MailModel(json) {
     
@@ -57,14 +58,16 @@ string Folder::tableName() {
     return Folder::TABLE_NAME;
 }
 
-vector<string> Folder::columnsForQuery() {
-    return vector<string>{"id", "data", "accountId", "version", "path", "role"};
+const ModelSchema & Folder::schema() {
+    return Folder::SCHEMA;
 }
 
 void Folder::bindToQuery(SQLite::Statement * query) {
     MailModel::bindToQuery(query);
-    query->bind(":path", path());
-    query->bind(":role", role());
+    ModelSchemaBinder(query, SCHEMA, MODEL_COLUMN_VERSION + 1)
+        .bind("path", path())
+        .bind("role", role())
+        .finish();
 }
 
 void Folder::beforeSave(MailStore * store) {
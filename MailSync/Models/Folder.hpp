@@ -25,6 +25,7 @@ class Folder : public MailModel {
     
 public:
     static string TABLE_NAME;
+    static ModelSchema SCHEMA;
 
     Folder(json & json);
     Folder(string id, string accountId, int version);
@@ -39,7 +40,7 @@ public:
     void setRole(string role);
   
     string tableName();
-    vector<string> columnsForQuery();
+    const ModelSchema & schema();
     void bindToQuery(SQLite::Statement * query);
 
     void beforeSave(MailStore * store);
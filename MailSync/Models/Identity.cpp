@@ -79,9 +79,9 @@ string Identity::constructorName() {
 	return "";
 }
 
-vector<string> Identity::columnsForQuery() {
+const ModelSchema & Identity::schema() {
     assert(false);
-	return {};
+    return MailModel::SCHEMA;
 }
 
 void Identity::bindToQuery(SQLite::Statement * query) {
@@ -45,7 +45,7 @@ public:
     string tableName();
     string constructorName();
     
-    vector<string> columnsForQuery();
+    const ModelSchema & schema();
     void bindToQuery(SQLite::Statement * query);
 };
 
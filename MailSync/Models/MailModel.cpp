@@ -18,28 +18,244 @@
 using namespace std;
 
 string MailModel::TABLE_NAME = "MailModel";
+ModelSchema MailModel::SCHEMA {{"id", "data", "accountId", "version"}};
+
+#pragma mark ModelSchema
+
+ModelSchema::ModelSchema(vector<string> columns) :
+    columns(columns)
+{
+    string cols{""};
+    string values{""};
+    string pairs{""};
+    int idIndex = 0;
+    for (int ii = 0; ii < (int)columns.size(); ii ++) {
+        string param = "?" + to_string(ii + 1);
+        cols += columns[ii] + ", ";
+        values += param + ", ";
+        if (columns[ii] == "id") {
+            idIndex = ii + 1;
+        } else {
+            pairs += columns[ii] + " = " + param + ", ";
+        }
+    }
+    if (columns.size()) {
+        insertSQL = " (" + cols.substr(0, cols.length() - 2) + ") VALUES (" + values.substr(0, values.length() - 2) + ")";
+    }
+    if (idIndex > 0 && pairs.length()) {
+        updateSQL = " SET " + pairs.substr(0, pairs.length() - 2) + " WHERE id = ?" + to_string(idIndex);
+    }
+}
+
+#pragma mark ModelSchemaBinder
+
+ModelSchemaBinder::ModelSchemaBinder(SQLite::Statement * query, const ModelSchema & schema, int position) :
+    _query(query),
+    _schema(schema),
+    _position(position)
+{
+}
+
+int ModelSchemaBinder::next(const char * column) {
+    if (_position > (int)_schema.columns.size() || _schema.columns[_position - 1] != column) {
+        throw SyncException("assertion-failure", string("Column ") + column + " is not at parameter " + to_string(_position) + " of the model schema.", false);
+    }
+    return _position++;
+}
+
+void ModelSchemaBinder::finish() {
+    if (_position != (int)_schema.columns.size() + 1) {
+        throw SyncException("assertion-failure", "Only " + to_string(_position - 1) + " of " + to_string(_schema.columns.size()) + " model schema columns were bound.", false);
+    }
+}
+
+#pragma mark LazyJSON
+
+LazyJSON::LazyJSON(MailModel * owner, const json & value) :
+    _value(value),
+    _raw(""),
+    _rawIsBinary(false),
+    _pending(false),
+    _owner(owner)
+{
+}
+
+// Note: copies don't inherit the owner - the owning model sets it.
+LazyJSON::LazyJSON(const LazyJSON & other) :
+    _value(other._value),
+    _raw(other._raw),
+    _rawIsBinary(other._rawIsBinary),
+    _pending(other._pending),
+    _owner(nullptr)
+{
+}
+
+LazyJSON & LazyJSON::operator=(const LazyJSON & other) {
+    _value = other._value;
+    _raw = other._raw;
+    _rawIsBinary = other._rawIsBinary;
+    _pending = other._pending;
+    return *this;
+}
+
+LazyJSON & LazyJSON::operator=(const json & value) {
+    _value = value;
+    _raw = "";
+    _pending = false;
+    return *this;
+}
+
+void LazyJSON::setOwner(MailModel * owner) {
+    _owner = owner;
+}
+
+void LazyJSON::setRaw(string raw, bool binary) {
+    _raw = std::move(raw);
+    _rawIsBinary = binary;
+    _pending = true;
+}
+
+bool LazyJSON::isInflated() const {
+    return !_pending;
+}
+
+void LazyJSON::inflate() const {
+    if (!_pending) {
+        return;
+    }
+    if (_rawIsBinary) {
+        _value = json::from_cbor(vector<uint8_t>(_raw.begin(), _raw.end()));
+    } else {
+        _value = json::parse(_raw);
+    }
+    string().swap(_raw);
+    _pending = false;
+
+    // let the model capture the state it compares against when it is saved
+    if (_owner) {
+        _owner->captureLoadedState();
+    }
+}
+
+json & LazyJSON::get() {
+    inflate();
+    return _value;
+}
+
+LazyJSON::operator json &() {
+    return get();
+}
+
+json & LazyJSON::operator[](const char * key) {
+    inflate();
+    return _value[key];
+}
+
+json & LazyJSON::operator[](const string & key) {
+    inflate();
+    return _value[key];
+}
+
+const json & LazyJSON::operator[](const char * key) const {
+    inflate();
+    return ((const json &)_value)[key];
+}
+
+size_t LazyJSON::count(const string & key) const {
+    inflate();
+    return _value.count(key);
+}
+
+size_t LazyJSON::erase(const string & key) {
+    inflate();
+    return _value.erase(key);
+}
+
+bool LazyJSON::is_object() const {
+    inflate();
+    return _value.is_object();
+}
+
+#pragma mark MailModel
 
 /* Note: If creating a brand new object, pass version = 0. */
 MailModel::MailModel(string id, string accountId, int version) :
-    _data({{"id", id}, {"aid", accountId}, {"v", version}})
+    _id(id),
+    _accountId(accountId),
+    _version(version),
+    _data(this, {{"id", id}, {"aid", accountId}, {"v", version}}),
+    _savedDataHash(0),
+    _boundDataHash(0)
 {
     captureInitialMetadataState();
 }
 
+/* The JSON isn't parsed until it's used. The id, accountId and version columns
+ are read if the query selected them so the model can be identified without it. */
 MailModel::MailModel(SQLite::Statement & query) :
-    _data(json::parse(query.getColumn("data").getString()))
+    _id(""),
+    _accountId(""),
+    _version(-1),
+    _data(this, nullptr),
+    _savedDataHash(0),
+    _boundDataHash(0)
 {
-    captureInitialMetadataState();
-}
+    for (int ii = 0; ii < query.getColumnCount(); ii ++) {
+        const char * name = query.getColumnName(ii);
+        if (strcmp(name, "id") == 0) {
+            _id = query.getColumn(ii).getString();
+        } else if (strcmp(name, "accountId") == 0) {
+            _accountId = query.getColumn(ii).getString();
+        } else if (strcmp(name, "version") == 0 && !query.getColumn(ii).isNull()) {
+            _version = query.getColumn(ii).getInt();
+        }
+    }
 
+    // Databases converted to CBOR by the removed `migrate-data-cbor` mode may still
+    // hold CBOR rows. They're read here and written back as JSON when next saved,
+    // or all at once by MailStore::migrateDataToJSON.
+    SQLite::Column col = query.getColumn("data");
+    string data;
+    if (col.isBlob()) {
+        data = string((const char *)col.getBlob(), col.getBytes());
+    } else {
+        data = col.getString();
+    }
+    _savedDataHash = hash<string>()(data);
+    _data.setRaw(std::move(data), col.isBlob());
+}
 
 MailModel::MailModel(json json) :
-    _data(json)
+    _id(""),
+    _accountId(""),
+    _version(-1),
+    _data(this, json),
+    _savedDataHash(0),
+    _boundDataHash(0)
 {
     assert(_data.is_object());
     captureInitialMetadataState();
 }
 
+MailModel::MailModel(const MailModel & other) :
+    _id(other._id),
+    _accountId(other._accountId),
+    _version(other._version),
+    _data(other._data),
+    _initialMetadataPluginIds(other._initialMetadataPluginIds),
+    _savedDataHash(other._savedDataHash),
+    _savedIndexedValues(other._savedIndexedValues),
+    _boundDataHash(other._boundDataHash)
+{
+    _data.setOwner(this);
+}
+
+/* Called when the JSON of a model loaded from the database is first parsed.
+ Subclasses that compare against their initial state when saved capture it here. */
+void MailModel::captureLoadedState() {
+    captureInitialMetadataState();
+}
+
 void MailModel::captureInitialMetadataState() {
     _initialMetadataPluginIds = {};
     if (_data.count("metadata")) {
@@ -49,30 +265,61 @@ void MailModel::captureInitialMetadataState() {
     }
 }
 
-string MailModel::id()
+void MailModel::captureIndexedValues() {
+    _savedIndexedValues = indexedValues();
+}
+
+const string & MailModel::id()
 {
-    return _data["id"].get<std::string>();
+    if (_id == "") {
+        _id = _data["id"].get<std::string>();
+    }
+    return _id;
 }
 
-string MailModel::accountId()
+const string & MailModel::accountId()
 {
-    return _data["aid"].get<std::string>();
+    if (_accountId == "") {
+        _accountId = _data["aid"].get<std::string>();
+    }
+    return _accountId;
 }
 
 int MailModel::version()
 {
-    return _data["v"].get<int>();
+    if (_version == -1) {
+        _version = _data["v"].get<int>();
+    }
+    return _version;
+}
+
+void MailModel::setVersion(int version)
+{
+    _data["v"] = version;
+    _version = version;
 }
 
 void MailModel::incrementVersion()
 {
-    _data["v"] = _data["v"].get<int>() + 1;
+    setVersion(version() + 1);
 }
 
 bool MailModel::supportsMetadata() {
     return false;
 }
 
+/* Returns the JSON text stored in the `data` column. The Electron client reads
+ `data` directly, so it is always written as JSON text. */
+string MailModel::serializedData() {
+    return toJSON().dump();
+}
+
+void MailModel::bindDataToQuery(SQLite::Statement * query, int index) {
+    string data = serializedData();
+    query->bind(index, data);
+    _boundDataHash = hash<string>()(data);
+}
+
 int MailModel::upsertMetadata(string pluginId, const json & value, int version)
 {
     assert(supportsMetadata());
@@ -124,12 +371,27 @@ json MailModel::toJSONDispatch()
     return this->toJSON();
 }
 
+/* Subclasses that want to be updated without rewriting their indexed columns
+ return the values bound to those columns here. A null value means that
+ every save should update every column. */
+json MailModel::indexedValues()
+{
+    return nullptr;
+}
+
+/* Subclasses return true if the next delta they dispatch carries something that
+ is not part of the saved data, so the save must happen even if it is unchanged. */
+bool MailModel::hasPendingDispatch()
+{
+    return false;
+}
+
 void MailModel::bindToQuery(SQLite::Statement * query) {
     auto _id = id();
-    query->bind(":id", _id);
-    query->bind(":data", this->toJSON().dump());
-    query->bind(":accountId", accountId());
-    query->bind(":version", version());
+    query->bind(MODEL_COLUMN_ID, _id);
+    bindDataToQuery(query, MODEL_COLUMN_DATA);
+    query->bind(MODEL_COLUMN_ACCOUNT_ID, accountId());
+    query->bind(MODEL_COLUMN_VERSION, version());
 
     if (id() != _id) {
         throw SyncException("assertion-failure", "The ID of a model changed while it was being serialized. How can this happen?", false);
@@ -207,6 +469,8 @@ void MailModel::afterSave(MailStore * store) {
                 worker->isSavingMetadataWithExpiration(lowestExpiration);
             }
         }
+
+        captureInitialMetadataState();
     }
 }
 
@@ -215,9 +479,8 @@ void MailModel::afterRemove(MailStore * store) {
     if (!supportsMetadata()) {
         return;
     }
-    string _id = id();
-    SQLite::Statement removePluginIds(store->db(), "DELETE FROM ModelPluginMetadata WHERE id = ?");
-    removePluginIds.bind(1, _id);
-    removePluginIds.exec();
+    auto removePluginIds = store->cachedStatement("DELETE FROM ModelPluginMetadata WHERE id = ?");
+    removePluginIds->bind(1, id());
+    removePluginIds->exec();
 }
 
@@ -25,25 +25,136 @@ using namespace std;
 using namespace nlohmann;
 
 class MailStore;
+class MailModel;
+
+// Parameter positions of the columns bound by MailModel::bindToQuery. Schemas of
+// models that use it list these columns first, in this order.
+#define MODEL_COLUMN_ID 1
+#define MODEL_COLUMN_DATA 2
+#define MODEL_COLUMN_ACCOUNT_ID 3
+#define MODEL_COLUMN_VERSION 4
+
+/*
+ The columns a model class is saved to. The column at index i is bound to
+ parameter ?(i + 1), so the save statements are built once from the schema
+ and bindToQuery binds each value by position rather than by name.
+ */
+struct ModelSchema {
+    vector<string> columns;
+
+    // " (id, data, ...) VALUES (?1, ?2, ...)"
+    string insertSQL;
+
+    // " SET data = ?2, ... WHERE id = ?1"
+    string updateSQL;
+
+    ModelSchema(vector<string> columns);
+};
+
+/*
+ Binds the values of a save statement in the order of a model's schema, starting
+ at parameter `position`. Each value names its column, and binding a column out of
+ order or finishing with columns left unbound is an assertion failure, so a
+ bindToQuery can't drift from its schema.
+ */
+class ModelSchemaBinder {
+    SQLite::Statement * _query;
+    const ModelSchema & _schema;
+    int _position;
+
+    int next(const char * column);
+
+public:
+    ModelSchemaBinder(SQLite::Statement * query, const ModelSchema & schema, int position);
+
+    template<typename T>
+    ModelSchemaBinder & bind(const char * column, const T & value) {
+        _query->bind(next(column), value);
+        return *this;
+    }
+
+    ModelSchemaBinder & bind(const char * column, const void * blob, int size) {
+        _query->bind(next(column), blob, size);
+        return *this;
+    }
+
+    void finish();
+};
+
+/*
+ Holds the JSON of a MailModel. Models loaded from the database keep the raw
+ bytes of their `data` column and parse them the first time the JSON is used,
+ so callers that only need a model's id, account or version never build the DOM.
+ Supports the subset of the json interface the models use on `_data`.
+ */
+class LazyJSON {
+    mutable json _value;
+    mutable string _raw;
+    mutable bool _rawIsBinary;
+    mutable bool _pending;
+    MailModel * _owner;
+
+    void inflate() const;
+
+public:
+    LazyJSON(MailModel * owner, const json & value);
+    LazyJSON(const LazyJSON & other);
+    LazyJSON & operator=(const LazyJSON & other);
+    LazyJSON & operator=(const json & value);
+
+    void setOwner(MailModel * owner);
+    void setRaw(string raw, bool binary);
+    bool isInflated() const;
+
+    json & get();
+    operator json &();
+
+    json & operator[](const char * key);
+    json & operator[](const string & key);
+    const json & operator[](const char * key) const;
+    size_t count(const string & key) const;
+    size_t erase(const string & key);
+    bool is_object() const;
+};
 
 class MailModel {
+    // native copies of the identity fields, filled in from the row's columns when
+    // the model is loaded or from the JSON on first use. Empty / -1 if unknown.
+    string _id;
+    string _accountId;
+    int _version;
+
 public:
-    json _data;
+    LazyJSON _data;
 
     map<string, int> _initialMetadataPluginIds;
-    
+
+    // hash of the serialized data last read from or written to the database (0 if
+    // unknown) and the values of the indexed columns at that time. Used by MailStore
+    // to skip saves that would not change anything and to avoid rewriting indexes.
+    size_t _savedDataHash;
+    json _savedIndexedValues;
+
+    // hash of the serialized data bound by the last call to bindDataToQuery
+    size_t _boundDataHash;
+
     static string TABLE_NAME;
+    static ModelSchema SCHEMA;
     virtual string tableName();
 
     MailModel(string id, string accountId, int version = 0);
     MailModel(SQLite::Statement & query);
     MailModel(json json);
+    MailModel(const MailModel & other);
     
+    virtual void captureLoadedState();
     void captureInitialMetadataState();
+    void captureIndexedValues();
     
-    string id();
-    string accountId();
+    const string & id();
+    const string & accountId();
     int version();
+    void setVersion(int version);
     void incrementVersion();
 
     int upsertMetadata(string pluginId, const json & value, int version = -1);
@@ -51,13 +162,18 @@ public:
 
     virtual bool supportsMetadata();
 
+    string serializedData();
+    void bindDataToQuery(SQLite::Statement * query, int index);
+
     virtual void bindToQuery(SQLite::Statement * query);
     
     virtual void beforeSave(MailStore * store);
     virtual void afterSave(MailStore * store);
     virtual void afterRemove(MailStore * store);
     
-    virtual vector<string> columnsForQuery() = 0;
+    virtual const ModelSchema & schema() = 0;
+    virtual json indexedValues();
+    virtual bool hasPendingDispatch();
 
     virtual json toJSON();
     virtual json toJSONDispatch();
@@ -20,6 +20,7 @@
 using namespace std;
 
 string Message::TABLE_NAME = "Message";
+ModelSchema Message::SCHEMA {{"id", "data", "accountId", "version", "headerMessageId", "subject", "gMsgId", "date", "draft", "unread", "starred", "remoteUID", "remoteXGMLabels", "remoteXGMLabelIds", "remoteFolderId", "threadId"}};
 
 /*
  The concept behind the "deletion placeholder" is that we need something 
@@ -130,7 +131,7 @@ Message::Message(SQLite::Statement & query) :
     MailModel(query)
 {
     _skipThreadUpdatesAfterSave = false;
-    _lastSnapshot = getSnapshot();
+    _lastSnapshot = MessageEmptySnapshot;
 }
 
 Message::Message(json json) :
@@ -144,6 +145,12 @@ Message::Message(json json) :
     }
 }
 
+void Message::captureLoadedState() {
+    MailModel::captureLoadedState();
+    _lastSnapshot = getSnapshot();
+    captureIndexedValues();
+}
+
 MessageSnapshot Message::getSnapshot() {
     MessageSnapshot s;
     s.unread = isUnread();
@@ -152,6 +159,7 @@ MessageSnapshot Message::getSnapshot() {
     s.fileCount = fileCountForThreadList();
     s.remoteXGMLabels = remoteXGMLabels();
     s.clientFolderId = clientFolderId();
+    s.remoteFolderId = remoteFolderId();
     return s;
 }
 
@@ -427,28 +435,106 @@ string Message::tableName() {
     return Message::TABLE_NAME;
 }
 
-vector<string> Message::columnsForQuery() {
-    return vector<string>{"id", "data", "accountId", "version", "headerMessageId", "subject", "gMsgId", "date", "draft", "unread", "starred", "remoteUID", "remoteXGMLabels", "remoteFolderId", "threadId"};
+const ModelSchema & Message::schema() {
+    return Message::SCHEMA;
 }
 
 void Message::bindToQuery(SQLite::Statement * query) {
     MailModel::bindToQuery(query);
-    query->bind(":date", (double)date());
-    query->bind(":unread", isUnread());
-    query->bind(":starred", isStarred());
-    query->bind(":draft", isDraft());
-    query->bind(":headerMessageId", headerMessageId());
-    query->bind(":subject", subject());
-    query->bind(":remoteUID", remoteUID());
-    query->bind(":remoteXGMLabels", remoteXGMLabels().dump());
-    query->bind(":remoteFolderId", remoteFolderId());
-    query->bind(":threadId", threadId());
-    query->bind(":gMsgId", gMsgId());
+    ModelSchemaBinder(query, SCHEMA, MODEL_COLUMN_VERSION + 1)
+        .bind("headerMessageId", headerMessageId())
+        .bind("subject", subject())
+        .bind("gMsgId", gMsgId())
+        .bind("date", (double)date())
+        .bind("draft", isDraft())
+        .bind("unread", isUnread())
+        .bind("starred", isStarred())
+        .bind("remoteUID", remoteUID())
+        .bind("remoteXGMLabels", remoteXGMLabels().dump())
+        .bind("remoteXGMLabelIds", _remoteXGMLabelIds.data(), (int)_remoteXGMLabelIds.size())
+        .bind("remoteFolderId", remoteFolderId())
+        .bind("threadId", threadId())
+        .finish();
+}
+
+json Message::indexedValues() {
+    return {
+        {"date", date()},
+        {"unread", isUnread()},
+        {"starred", isStarred()},
+        {"draft", isDraft()},
+        {"headerMessageId", headerMessageId()},
+        {"subject", subject()},
+        {"remoteUID", remoteUID()},
+        {"remoteXGMLabels", remoteXGMLabels()},
+        {"remoteFolderId", remoteFolderId()},
+        {"threadId", threadId()},
+        {"gMsgId", gMsgId()},
+    };
+}
+
+bool Message::hasPendingDispatch() {
+    return _bodyForDispatch.length() > 0;
+}
+
+void Message::beforeSave(MailStore * store) {
+    MailModel::beforeSave(store);
+
+    // the label column the sync worker compares is stored as label dictionary indexes
+    _remoteXGMLabelIds = store->packedLabelIdsForLabels(accountId(), remoteXGMLabels().get<vector<string>>());
+}
+
+/*
+ Messages are fetched from the body sync queue by priority and then by date.
+ Drafts come first, and the inbox comes before the other folders so
+ an account-wide read of the queue can start with what the user will see.
+ The V10 migration computes the same values in SQL.
+ */
+int Message::pendingBodyPriority() {
+    string role = remoteFolder()["role"].get<string>();
+    int priority = isDraft() ? 4 : 0;
+    if (role == "inbox") {
+        priority += 2;
+    } else if (role == "sent" || role == "drafts") {
+        priority += 1;
+    }
+    return priority;
+}
+
+bool Message::wantsPendingBody() {
+    string role = remoteFolder()["role"].get<string>();
+    if (role == "spam" || role == "trash") {
+        return false;
+    }
+    if (remoteUID() == 0 || remoteUID() >= UINT32_MAX - 2) {
+        return false;
+    }
+    return isDraft() || date() > time(0) - BODY_SYNC_MAX_AGE;
 }
 
 void Message::afterSave(MailStore * store) {
     MailModel::afterSave(store);
 
+    // queue new messages for body sync, and requeue messages that have moved
+    // since the queue is read one folder at a time.
+    if (version() == 1 || _lastSnapshot.remoteFolderId != remoteFolderId()) {
+        if (wantsPendingBody()) {
+            auto enqueue = store->cachedStatement("INSERT OR REPLACE INTO PendingBody (id, accountId, folderId, draft, priority, date) SELECT ?, ?, ?, ?, ?, ? WHERE NOT EXISTS (SELECT 1 FROM MessageBody WHERE id = ?)");
+            enqueue->bind(1, id());
+            enqueue->bind(2, accountId());
+            enqueue->bind(3, remoteFolderId());
+            enqueue->bind(4, isDraft() ? 1 : 0);
+            enqueue->bind(5, pendingBodyPriority());
+            enqueue->bind(6, (double)date());
+            enqueue->bind(7, id());
+            enqueue->exec();
+        } else if (version() > 1) {
+            auto dequeue = store->cachedStatement("DELETE FROM PendingBody WHERE id = ?");
+            dequeue->bind(1, id());
+            dequeue->exec();
+        }
+    }
+
     // if we have a thread, keep the thread's folder, label, and unread counters
     // in sync by providing it with a before + after snapshot of this message.
     if (_skipThreadUpdatesAfterSave) {
@@ -457,14 +543,16 @@ void Message::afterSave(MailStore * store) {
     if (threadId() == "") {
         return;
     }
-    auto thread = store->find<Thread>(Query().equal("id", threadId()));
+    // The thread is kept in memory and written once when the transaction commits,
+    // so saving many messages in the same thread only writes the thread once.
+    auto thread = store->findForDeferredSave<Thread>(threadId());
     if (thread == nullptr) {
         return;
     }
 
-    auto allLabels = store->allLabelsCache(accountId());
-    thread->applyMessageAttributeChanges(_lastSnapshot, this, allLabels);
-    store->save(thread.get());
+    auto allLabels = store->labelSnapshot(accountId());
+    thread->applyMessageAttributeChanges(_lastSnapshot, this, *allLabels);
+    store->saveDeferred(thread.get());
     _lastSnapshot = getSnapshot();
 }
 
@@ -477,23 +565,27 @@ void Message::afterRemove(MailStore * store) {
     if (threadId() == "") {
         return;
     }
-    auto thread = store->find<Thread>(Query().equal("id", threadId()));
+    auto thread = store->findForDeferredSave<Thread>(threadId());
     if (thread == nullptr) {
         return;
     }
     
-    auto allLabels = store->allLabelsCache(accountId());
-    thread->applyMessageAttributeChanges(_lastSnapshot, nullptr, allLabels);
+    auto allLabels = store->labelSnapshot(accountId());
+    thread->applyMessageAttributeChanges(_lastSnapshot, nullptr, *allLabels);
     if (thread->folders().size() == 0) {
         store->remove(thread.get());
     } else {
-        store->save(thread.get());
+        store->saveDeferred(thread.get());
     }
     
     // Also delete our draft body
-    SQLite::Statement removeBody(store->db(), "DELETE FROM MessageBody WHERE id = ?");
-    removeBody.bind(1, id());
-    removeBody.exec();
+    auto removeBody = store->cachedStatement("DELETE FROM MessageBody WHERE id = ?");
+    removeBody->bind(1, id());
+    removeBody->exec();
+
+    auto dequeue = store->cachedStatement("DELETE FROM PendingBody WHERE id = ?");
+    dequeue->bind(1, id());
+    dequeue->exec();
 }
 
 json Message::toJSONDispatch() {
@@ -30,6 +30,9 @@ class File;
 class MailStore;
 class Message;
 
+// Messages newer than this, and drafts, are queued in PendingBody for body sync
+#define BODY_SYNC_MAX_AGE   (24 * 60 * 60 * 30 * 3) // three months
+
 // Snapshot concept
 
 struct MessageSnapshot {
@@ -39,9 +42,10 @@ struct MessageSnapshot {
     size_t fileCount;
     json remoteXGMLabels;
     string clientFolderId;
+    string remoteFolderId;
 };
 
-static MessageSnapshot MessageEmptySnapshot = MessageSnapshot{false, false, false, 0, nullptr, ""};
+static MessageSnapshot MessageEmptySnapshot = MessageSnapshot{false, false, false, 0, nullptr, "", ""};
 
 // Message
 
@@ -49,9 +53,11 @@ class Message : public MailModel {
 
     string _bodyForDispatch;
     MessageSnapshot _lastSnapshot;
+    string _remoteXGMLabelIds;
 
 public:
     static string TABLE_NAME;
+    static ModelSchema SCHEMA;
     
     static shared_ptr<Message> messageWithDeletionPlaceholderFor(shared_ptr<Message> draft);
 
@@ -63,6 +69,7 @@ public:
 
     // mutable attributes
 
+    void captureLoadedState();
     MessageSnapshot getSnapshot();
     
     bool isDeletionPlaceholder();
@@ -139,12 +146,18 @@ public:
     string headerMessageId();
     
     string tableName();
-    vector<string> columnsForQuery();
+    const ModelSchema & schema();
     void bindToQuery(SQLite::Statement * query);
+    json indexedValues();
+    bool hasPendingDispatch();
 
+    void beforeSave(MailStore * store);
     void afterSave(MailStore * store);
     void afterRemove(MailStore * store);
 
+    int pendingBodyPriority();
+    bool wantsPendingBody();
+
     json toJSONDispatch();
 
     bool _skipThreadUpdatesAfterSave;
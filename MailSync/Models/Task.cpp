@@ -18,6 +18,7 @@ using namespace std;
 using namespace mailcore;
 
 string Task::TABLE_NAME = "Task";
+ModelSchema Task::SCHEMA {{"id", "data", "accountId", "version", "status"}};
 
 Task::Task(string constructorName, string accountId, json taskSpecificData) :
     MailModel(MailUtils::idRandomlyGenerated(), accountId) {
@@ -74,11 +75,13 @@ string Task::tableName() {
     return Task::TABLE_NAME;
 }
 
-vector<string> Task::columnsForQuery() {
-    return vector<string>{"id", "data", "accountId", "version", "status"};
+const ModelSchema & Task::schema() {
+    return Task::SCHEMA;
 }
 
 void Task::bindToQuery(SQLite::Statement * query) {
     MailModel::bindToQuery(query);
-    query->bind(":status", status());
+    ModelSchemaBinder(query, SCHEMA, MODEL_COLUMN_VERSION + 1)
+        .bind("status", status())
+        .finish();
 }
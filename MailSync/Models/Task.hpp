@@ -27,6 +27,7 @@ class Task : public MailModel {
     
 public:
     static string TABLE_NAME;
+    static ModelSchema SCHEMA;
 
     Task(string constructorName, string accountId, json taskSpecificData);
     
@@ -46,7 +47,7 @@ public:
     json error();
     void setError(json e);
 
-    vector<string> columnsForQuery();
+    const ModelSchema & schema();
     void bindToQuery(SQLite::Statement * query);
 };
 
@@ -18,6 +18,7 @@
 using namespace std;
 
 string Thread::TABLE_NAME = "Thread";
+ModelSchema Thread::SCHEMA {{"id", "data", "accountId", "version", "gThrId", "unread", "starred", "inAllMail", "subject", "lastMessageTimestamp", "lastMessageReceivedTimestamp", "lastMessageSentTimestamp", "firstMessageTimestamp", "hasAttachments"}};
 
 Thread::Thread(string msgId, string accountId, string subject, uint64_t gThreadId) :
     MailModel("t:" + msgId, accountId, 0)
@@ -50,7 +51,12 @@ Thread::Thread(string msgId, string accountId, string subject, uint64_t gThreadI
 Thread::Thread(SQLite::Statement & query) :
 MailModel(query)
 {
+}
+
+void Thread::captureLoadedState() {
+    MailModel::captureLoadedState();
     captureInitialState();
+    captureIndexedValues();
 }
 
 bool Thread::supportsMetadata() {
@@ -164,7 +170,7 @@ void Thread::resetCountedAttributes() {
     // now call applyMessageAttributeChanges(empty, msg) for all messages
 }
 
-void Thread::applyMessageAttributeChanges(MessageSnapshot & old, Message * next, vector<shared_ptr<Label>> allLabels) {
+void Thread::applyMessageAttributeChanges(MessageSnapshot & old, Message * next, const LabelSnapshot & allLabels) {
     // decrement basic attributes
     setUnread(unread() - old.unread);
     setStarred(starred() - old.starred);
@@ -196,7 +202,7 @@ void Thread::applyMessageAttributeChanges(MessageSnapshot & old, Message * next,
     // Note: Since labels are within `All Mail`, a message only contributes
     // to a label's unread count if it is also in `All Mail`.
     for (auto& mlname : old.remoteXGMLabels) {
-        shared_ptr<Label> ml = MailUtils::labelForXGMLabelName(mlname, allLabels);
+        shared_ptr<Label> ml = allLabels.labelForXGMLabelName(mlname.get_ref<const string &>());
         if (ml == nullptr) {
             continue;
         }
@@ -277,7 +283,7 @@ void Thread::applyMessageAttributeChanges(MessageSnapshot & old, Message * next,
         
         // update our label set + increment refcounts
         for (auto& mlname : next->remoteXGMLabels()) {
-            shared_ptr<Label> ml = MailUtils::labelForXGMLabelName(mlname, allLabels);
+            shared_ptr<Label> ml = allLabels.labelForXGMLabelName(mlname.get_ref<const string &>());
             if (ml == nullptr) {
                 continue;
             }
@@ -327,22 +333,28 @@ string Thread::tableName() {
     return Thread::TABLE_NAME;
 }
 
-vector<string> Thread::columnsForQuery() {
-    return vector<string>{"id", "data", "accountId", "version", "gThrId", "unread", "starred", "inAllMail", "subject", "lastMessageTimestamp", "lastMessageReceivedTimestamp", "lastMessageSentTimestamp", "firstMessageTimestamp", "hasAttachments"};
+const ModelSchema & Thread::schema() {
+    return Thread::SCHEMA;
 }
 
 void Thread::bindToQuery(SQLite::Statement * query) {
     MailModel::bindToQuery(query);
-    query->bind(":unread", unread());
-    query->bind(":starred", starred());
-    query->bind(":subject", subject());
-    query->bind(":inAllMail", inAllMail());
-    query->bind(":gThrId", gThrId());
-    query->bind(":lastMessageTimestamp", (double)lastMessageTimestamp());
-    query->bind(":lastMessageSentTimestamp", (double)lastMessageSentTimestamp());
-    query->bind(":lastMessageReceivedTimestamp", (double)lastMessageReceivedTimestamp());
-    query->bind(":firstMessageTimestamp", (double)firstMessageTimestamp());
-    query->bind(":hasAttachments", (double)attachmentCount());
+    ModelSchemaBinder(query, SCHEMA, MODEL_COLUMN_VERSION + 1)
+        .bind("gThrId", gThrId())
+        .bind("unread", unread())
+        .bind("starred", starred())
+        .bind("inAllMail", inAllMail())
+        .bind("subject", subject())
+        .bind("lastMessageTimestamp", (double)lastMessageTimestamp())
+        .bind("lastMessageReceivedTimestamp", (double)lastMessageReceivedTimestamp())
+        .bind("lastMessageSentTimestamp", (double)lastMessageSentTimestamp())
+        .bind("firstMessageTimestamp", (double)firstMessageTimestamp())
+        .bind("hasAttachments", (double)attachmentCount())
+        .finish();
+}
+
+json Thread::indexedValues() {
+    return {unread(), starred(), subject(), inAllMail(), gThrId(), lastMessageTimestamp(), lastMessageSentTimestamp(), lastMessageReceivedTimestamp(), firstMessageTimestamp(), attachmentCount()};
 }
 
 void Thread::afterSave(MailStore * store) {
@@ -407,12 +419,13 @@ void Thread::afterSave(MailStore * store) {
 
         // update the thread search table if we're indexed
         if (searchRowId()) {
-            SQLite::Statement update(store->db(), "UPDATE ThreadSearch SET categories = ? WHERE rowid = ?");
-            update.bind(1, categoriesSearchString());
-            update.bind(2, (double)searchRowId());
-            update.exec();
+            store->updateThreadSearchCategories(searchRowId(), categoriesSearchString());
         }
     }
+
+    // The rows above now reflect our state. If this instance is changed and saved
+    // again, only the changes since this save should be applied to the counters.
+    captureInitialState();
 }
 
 void Thread::afterRemove(MailStore * store) {
@@ -425,10 +438,11 @@ void Thread::afterRemove(MailStore * store) {
 
     // Delete search entry
     if (searchRowId()) {
-        SQLite::Statement update(store->db(), "DELETE FROM ThreadSearch WHERE rowid = ?");
-        update.bind(1, (double)searchRowId());
-        update.exec();
+        store->removeThreadSearch(searchRowId());
     }
+    SQLite::Statement dequeue(store->db(), "DELETE FROM ThreadSearchQueue WHERE threadId = ?");
+    dequeue.bind(1, id());
+    dequeue.exec();
 }
 
 
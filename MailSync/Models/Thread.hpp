@@ -21,6 +21,7 @@
 
 #include "MailModel.hpp"
 #include "Label.hpp"
+#include "LabelSnapshot.hpp"
 #include "Message.hpp"
 
 #include "json.hpp"
@@ -37,11 +38,13 @@ class Thread : public MailModel {
     
 public:
     static string TABLE_NAME;
+    static ModelSchema SCHEMA;
 
     Thread(string msgId, string accountId, string subject, uint64_t gThreadId);
     Thread(SQLite::Statement & query);
     
     bool supportsMetadata();
+    void captureLoadedState();
 
     string subject();
     void setSubject(string s);
@@ -68,12 +71,13 @@ public:
     string categoriesSearchString();
 
     void resetCountedAttributes();
-    void applyMessageAttributeChanges(MessageSnapshot & old, Message * next, vector<shared_ptr<Label>> allLabels);
+    void applyMessageAttributeChanges(MessageSnapshot & old, Message * next, const LabelSnapshot & allLabels);
     void upsertReferences(SQLite::Database & db, string headerMessageId, mailcore::Array * references);
 
     string tableName();
-    vector<string> columnsForQuery();
+    const ModelSchema & schema();
     void bindToQuery(SQLite::Statement * query);
+    json indexedValues();
     void afterSave(MailStore * store);
     void afterRemove(MailStore * store);
 
@@ -10,59 +10,71 @@
 #include <SQLiteCpp/SQLiteCpp.h>
 
 #include "json.hpp"
-#include "MailUtils.hpp"
-#include "SyncException.hpp"
+#include "ValueSet.hpp"
 
 using namespace nlohmann;
 using namespace std;
 
 
-// TODO: figure out how to use templates for this
+Query::Query() noexcept : _clauses({}), _limit(0), _sql(""), _sqlBuilt(false) {
+}
+
+// Returns the clause for the column and operator, replacing any value it had.
+Query::Clause & Query::clause(const string & col, const char * op, int type) {
+    _sqlBuilt = false;
+    for (auto & c : _clauses) {
+        if (c.col == col && c.op == op) {
+            c.type = type;
+            return c;
+        }
+    }
+    _clauses.push_back(Clause{col, op, type, 0, 0, "", ValueSet()});
+    return _clauses.back();
+}
 
-Query::Query() noexcept : _clauses({}), _limit(0) {
+Query & Query::integer(const string & col, const char * op, long long val) {
+    clause(col, op, QUERY_VALUE_INTEGER).integer = val;
+    return *this;
+}
+
+Query & Query::real(const string & col, const char * op, double val) {
+    clause(col, op, QUERY_VALUE_REAL).real = val;
+    return *this;
 }
 
 Query & Query::equal(string col, string val) {
-    _clauses[col] = {{"op","="}, {"rhs", val}};
+    clause(col, "=", QUERY_VALUE_TEXT).text = val;
     return *this;
 }
 
 Query & Query::equal(string col, double val) {
-    _clauses[col] = {{"op","="}, {"rhs", val}};
-    return *this;
+    return real(col, "=", val);
 }
 
 Query & Query::equal(string col, vector<string> & val) {
-    if (val.size() > 999) {
-        spdlog::get("logger")->warn("Attempting to construct WHERE {} IN () query with >999 values ({}), this will fail and should be reported.", col, val.size());
-    }
-    _clauses[col] = {{"op","="}, {"rhs", val}};
+    clause(col, "=", QUERY_VALUE_SET).set = ValueSet(val);
     return *this;
 }
 
 Query & Query::equal(string col, vector<uint32_t> & val) {
-    _clauses[col] = {{"op","="}, {"rhs", val}};
+    clause(col, "=", QUERY_VALUE_SET).set = ValueSet(val);
     return *this;
 }
 
 Query & Query::gt(string col, double val) {
-    _clauses[col] = {{"op",">"}, {"rhs", val}};
-    return *this;
+    return real(col, ">", val);
 }
 
 Query & Query::gte(string col, double val) {
-    _clauses[col] = {{"op",">="}, {"rhs", val}};
-    return *this;
+    return real(col, ">=", val);
 }
 
 Query & Query::lt(string col, double val) {
-    _clauses[col] = {{"op","<"}, {"rhs", val}};
-    return *this;
+    return real(col, "<", val);
 }
 
 Query & Query::lte(string col, double val) {
-    _clauses[col] = {{"op","<="}, {"rhs", val}};
-    return *this;
+    return real(col, "<=", val);
 }
 
 Query & Query::limit(int l) {
@@ -74,59 +86,41 @@ int Query::getLimit() {
     return _limit;
 }
 
-string Query::getSQL() {
-    string result = "";
+const string & Query::getSQL() {
+    if (_sqlBuilt) {
+        return _sql;
+    }
+    _sql = "";
 
-    if (_clauses.size() > 0) {
-        result += " WHERE ";
+    for (auto & c : _clauses) {
+        _sql += _sql.length() ? " AND " : " WHERE ";
 
-        for (json::iterator it = _clauses.begin(); it != _clauses.end(); ++it) {
-            if (it != _clauses.begin()) {
-                result += " AND ";
-            }
-            string op = it.value()["op"].get<string>();
-            json & rhs = it.value()["rhs"];
-            
-            if (rhs.is_array()) {
-                if (op != "=") {
-                    throw SyncException("query-builder", "Cannot use query operator " + op + " with an array of values", true);
-                }
-                if (rhs.size() == 0) {
-                    result += "0 = 1";
-                    continue;
-                }
-                result += it.key() + " IN (" + MailUtils::qmarks(rhs.size()) + ")";
+        if (c.type == QUERY_VALUE_SET) {
+            if (c.set.size() == 0) {
+                _sql += "0 = 1";
             } else {
-                result += it.key() + " " + op + " ?";
+                // bound as one parameter, so the SQL is the same for any number of values
+                _sql += c.col + " IN (" VALUE_SET_SELECT ")";
             }
+        } else {
+            _sql += c.col + " " + c.op + " ?";
         }
     }
-    return result;
+    _sqlBuilt = true;
+    return _sql;
 }
 
 void Query::bind(SQLite::Statement & query) {
     int ii = 1;
-    for (json::iterator it = _clauses.begin(); it != _clauses.end(); ++it) {
-        json & rhs = it.value()["rhs"];
-
-        if (rhs.is_array()) {
-            for (json::iterator at = rhs.begin(); at != rhs.end(); ++at) {
-                if (at->is_number()) {
-                    query.bind(ii++, at->get<double>());
-                } else if (at->is_string()) {
-                    query.bind(ii++, at->get<string>());
-                } else {
-                    throw SyncException("query-builder", "Unsure of how to bind json to sqlite", true);
-                }
-            }
-        } else {
-            if (rhs.is_number()) {
-                query.bind(ii++, rhs.get<double>());
-            } else if (rhs.is_string()) {
-                query.bind(ii++, rhs.get<string>());
-            } else {
-                throw SyncException("query-builder", "Unsure of how to bind json to sqlite", true);
-            }
+    for (auto & c : _clauses) {
+        if (c.type == QUERY_VALUE_INTEGER) {
+            query.bind(ii++, c.integer);
+        } else if (c.type == QUERY_VALUE_REAL) {
+            query.bind(ii++, c.real);
+        } else if (c.type == QUERY_VALUE_TEXT) {
+            query.bind(ii++, c.text);
+        } else if (c.set.size() > 0) {
+            c.set.bind(query, ii++);
         }
     }
 }
@@ -12,19 +12,48 @@
 #include <stdio.h>
 #include <string>
 #include <vector>
+#include <type_traits>
 
 #include <SQLiteCpp/SQLiteCpp.h>
 
 #include "json.hpp"
+#include "ValueSet.hpp"
 
 using namespace nlohmann;
 using namespace std;
 
+#define QUERY_VALUE_INTEGER 0
+#define QUERY_VALUE_REAL 1
+#define QUERY_VALUE_TEXT 2
+#define QUERY_VALUE_SET 3
 
+/*
+ A WHERE clause built from column comparisons. Values are kept with their types
+ and bound as integers, doubles, text or a single set parameter (see ValueSet).
+ The SQL only depends on the columns and operators, not the values, so it's
+ built once and the statement cache reuses the prepared query across calls.
+ */
 class Query {
-    json _clauses;
+    struct Clause {
+        string col;
+        string op;
+        int type;
+        long long integer;
+        double real;
+        string text;
+        ValueSet set;
+    };
+
+    // one clause per column and operator, in the order they were added
+    vector<Clause> _clauses;
     int _limit;
-    
+    string _sql;
+    bool _sqlBuilt;
+
+    Clause & clause(const string & col, const char * op, int type);
+    Query & integer(const string & col, const char * op, long long val);
+    Query & real(const string & col, const char * op, double val);
+
 public:
     Query() noexcept;
     
@@ -38,10 +67,22 @@ public:
     Query & lt(string col, double val);
     Query & lte(string col, double val);
 
+    // integers (and bools) are bound as integers rather than doubles
+    template<typename T, typename = typename enable_if<is_integral<T>::value>::type>
+    Query & equal(string col, T val) { return integer(col, "=", (long long)val); }
+    template<typename T, typename = typename enable_if<is_integral<T>::value>::type>
+    Query & gt(string col, T val) { return integer(col, ">", (long long)val); }
+    template<typename T, typename = typename enable_if<is_integral<T>::value>::type>
+    Query & gte(string col, T val) { return integer(col, ">=", (long long)val); }
+    template<typename T, typename = typename enable_if<is_integral<T>::value>::type>
+    Query & lt(string col, T val) { return integer(col, "<", (long long)val); }
+    template<typename T, typename = typename enable_if<is_integral<T>::value>::type>
+    Query & lte(string col, T val) { return integer(col, "<=", (long long)val); }
+
     Query & limit(int l);
 
     int getLimit();
-    std::string getSQL();
+    const std::string & getSQL();
 
     void bind(SQLite::Statement & query);
 };
@@ -13,6 +13,7 @@
 #include "SyncWorker.hpp"
 #include "MailUtils.hpp"
 #include "MailStoreTransaction.hpp"
+#include "MemoryBudget.hpp"
 #include "Folder.hpp"
 #include "Label.hpp"
 #include "File.hpp"
@@ -241,12 +242,61 @@ void SyncWorker::markAllFoldersBusy() {
     }
 }
 
+/*
+ Database upkeep that runs when the background worker has caught up and is
+ about to sleep, so it doesn't compete with sync for the write lock.
+ */
+void SyncWorker::idleMaintenance() {
+    // none of this is required, so failures (eg: SQLITE_BUSY) are logged and ignored.
+    // Threads left in the search queue are indexed on a later pass.
+    try {
+        // index everything queued for search while we have nothing else to do
+        indexQueuedThreads(time(0));
+    } catch (SQLite::Exception & ex) {
+        logger->warn("Search indexing failed: {}", ex.what());
+    }
+    try {
+        store->convertToIncrementalVacuum();
+        store->vacuumIncrementally();
+    } catch (SQLite::Exception & ex) {
+        logger->warn("Incremental vacuum failed: {}", ex.what());
+    }
+    try {
+        store->maintainSearchIndexes();
+    } catch (SQLite::Exception & ex) {
+        logger->warn("Search index maintenance failed: {}", ex.what());
+    }
+    store->checkpointIdle();
+
+    // give memory back if the system is running low, and take it back once it isn't
+    MemoryBudget::checkMemoryPressure();
+    store->applyMemoryBudget();
+}
+
+void SyncWorker::indexQueuedThreads(time_t queuedBefore) {
+    auto start = chrono::steady_clock::now();
+    int indexed = 0;
+    int batch = 0;
+    do {
+        batch = processor->indexQueuedThreads(THREAD_SEARCH_INDEX_BATCH, queuedBefore);
+        indexed += batch;
+    } while (batch == THREAD_SEARCH_INDEX_BATCH);
+
+    if (indexed > 0) {
+        auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+        logger->info("Search index: rebuilt {} threads in {}ms.", indexed, ms);
+    }
+}
 
 bool SyncWorker::syncNow()
 {
     AutoreleasePool pool;
     bool syncAgainImmediately = false;
 
+    // a long sync pass may never reach idleMaintenance, so check for memory pressure here too
+    MemoryBudget::checkMemoryPressure();
+    store->applyMemoryBudget();
+
     vector<shared_ptr<Folder>> folders = syncFoldersAndLabels();
     bool hasCondstore = session.storedCapabilities()->containsIndex(IMAPCapabilityCondstore);
     bool hasQResync = session.storedCapabilities()->containsIndex(IMAPCapabilityQResync);
@@ -416,9 +466,12 @@ bool SyncWorker::syncNow()
             moreToDo = true;
         }
         
-        // Update cache metrics and cleanup bodies we don't want anymore.
-        // these queries are expensive so we do this infrequently and increment
-        // blindly as we download bodies.
+        // Update cache metrics. These are read from counters maintained by triggers,
+        // so they're cheap enough to refresh on every pass.
+        localStatus[LS_BODIES_PRESENT] = countBodiesDownloaded(*folder);
+        localStatus[LS_BODIES_WANTED] = countBodiesNeeded(*folder);
+
+        // Cleanup bodies we don't want anymore. This is expensive so we do it infrequently.
         time_t lastCleanup = localStatus.count(LS_LAST_CLEANUP) ? localStatus[LS_LAST_CLEANUP].get<time_t>() : 0;
         if (syncedMinUID == 1 && (time(0) - lastCleanup > CACHE_CLEANUP_INTERVAL)) {
             cleanMessageCache(*folder);
@@ -442,7 +495,12 @@ bool SyncWorker::syncNow()
     logger->info("Sync loop deleting unlinked messages with phase {}.", unlinkPhase);
     processor->deleteMessagesStillUnlinkedFromPhase(unlinkPhase);
     
+    // threads that have waited too long for the idle pass are indexed now
+    indexQueuedThreads(time(0) - THREAD_SEARCH_MAX_DELAY);
+
     logger->info("Sync loop complete.");
+    store->logStats();
+    MemoryBudget::logStats();
     iterationsSinceLaunch += 1;
 
     return syncAgainImmediately;
@@ -689,7 +747,13 @@ void SyncWorker::syncFolderUIDRange(Folder & folder, Range range, bool heavyInit
     // comes back is already stale, we want to calculate changes (deletes, especially) based on
     // old <> old, not new <> old, since new, freshly downloaded messages will always be missing
     // in the stale server set and will be marked for deletion. Re-downloading is better.
-    map<uint32_t, MessageAttributes> local(store->fetchMessagesAttributesInRange(range, folder));
+    // The folder's UIDs are cached in memory, so this is a shared snapshot and not a database query.
+    auto local = store->fetchLocalFolderUIDs(folder);
+    uint32_t localMaxUID = LOCAL_FOLDER_UID_MAX;
+    if (range.length != UINT64_MAX && range.location + range.length < localMaxUID) {
+        localMaxUID = (uint32_t)(range.location + range.length);
+    }
+    vector<uint32_t> localUIDs = local->uids.uidsInRange((uint32_t)range.location, localMaxUID);
 
     // Step 2: Fetch the remote attributes (unread, starred, etc.) for the same UID range
     time_t syncDataTimestamp = time(0);
@@ -699,38 +763,46 @@ void SyncWorker::syncFolderUIDRange(Folder & folder, Range range, bool heavyInit
         throw SyncException(err, "syncFolderUIDRange - fetchMessagesByUID");
     }
 
-    clock_t lastSleepClock = clock();
+    logger->info("- remote={}, local={}", remote->count(), localUIDs.size());
 
-    logger->info("- remote={}, local={}", remote->count(), local.size());
+    // Messages are inserted in chunks of the processor's batch size as we walk the response,
+    // and released from `remote` once they've been handled, so the fetched headers don't all
+    // have to stay in memory until the end of the range.
+    Array * toInsert = Array::array();
+    auto flushInserts = [&]() {
+        if (toInsert->count() == 0) {
+            return;
+        }
+        auto inserted = processor->insertMessages(toInsert, folder, syncDataTimestamp);
+        if (syncedMessages != nullptr) {
+            syncedMessages->insert(syncedMessages->end(), inserted.begin(), inserted.end());
+        }
+        toInsert->removeAllObjects();
+    };
+    UIDBitmap remoteUIDs;
 
     for (int ii = ((int)remote->count()) - 1; ii >= 0; ii--) {
-        // Never sit in a hard loop inserting things into the database for more than 250ms.
-        // This ensures we don't starve another thread waiting for a database connection
-        if (((clock() - lastSleepClock) * 4) / CLOCKS_PER_SEC > 1) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(50));
-            lastSleepClock = clock();
-        }
-        
         IMAPMessage * remoteMsg = (IMAPMessage *)(remote->objectAtIndex(ii));
         uint32_t remoteUID = remoteMsg->uid();
 
         // Step 3: Collect messages that are different or not in our local UID set.
-        bool inFolder = (local.count(remoteUID) > 0);
-        bool same = inFolder && MessageAttributesMatch(local[remoteUID], MessageAttributesForMessage(remoteMsg));
+        bool inFolder = local->uids.contains(remoteUID);
+        bool same = false;
+        if (inFolder) {
+            MessageAttributes remoteAttrs = MessageAttributesForMessage(remoteMsg);
+            remoteAttrs.labelIds = store->labelIdsForLabels(folder.accountId(), remoteAttrs.labels);
+            same = local->matches(remoteAttrs);
+        }
 
         if (!inFolder || !same) {
-            // Step 4: Attempt to insert the new message. If we get unique exceptions,
-            // look for the existing message and do an update instead. This happens whenever
-            // a message has moved between folders or it's attributes have changed.
-            
-            // Note: We could prefetch all changedOrMissingIDs and then decide to update/insert,
-            // but we can only query for 500 at a time, it /feels/ nasty, and we /could/ always
-            // hit the exception anyway since another thread could be IDLEing and retrieving
-            // the messages alongside us.
+            // Step 4: Insert the new message, or update the existing one if we already have it.
+            // This happens whenever a message has moved between folders or it's attributes have
+            // changed. insertMessages looks up which IDs exist in bulk, and still falls back to
+            // an update if another thread IDLEing alongside us inserts the message first.
             if (heavyInitialRequest) {
-                auto local = processor->insertFallbackToUpdateMessage(remoteMsg, folder, syncDataTimestamp);
-                if (syncedMessages != nullptr) {
-                    syncedMessages->push_back(local);
+                toInsert->addObject(remoteMsg);
+                if ((int)toInsert->count() >= processor->insertBatchLimit()) {
+                    flushInserts();
                 }
             } else {
                 if (heavyNeededIdeal < MAX_FULL_HEADERS_REQUEST_SIZE) {
@@ -740,8 +812,14 @@ void SyncWorker::syncFolderUIDRange(Folder & folder, Range range, bool heavyInit
             }
         }
         
-        local.erase(remoteUID);
+        remoteUIDs.add(remoteUID);
+        remote->removeLastObject();
     }
+
+    // release the snapshot so the saves below don't have to copy it
+    local = nullptr;
+
+    flushInserts();
     
     if (!heavyInitialRequest && heavyNeeded->count() > 0) {
         logger->info("- Fetching full headers for {} (of {} needed)", heavyNeeded->count(), heavyNeededIdeal);
@@ -761,28 +839,28 @@ void SyncWorker::syncFolderUIDRange(Folder & folder, Range range, bool heavyInit
             throw SyncException(err, "syncFolderUIDRange - fetchMessagesByUID (heavy)");
         }
         for (int ii = ((int)remote->count()) - 1; ii >= 0; ii--) {
-            IMAPMessage * remoteMsg = (IMAPMessage *)(remote->objectAtIndex(ii));
-            auto local = processor->insertFallbackToUpdateMessage(remoteMsg, folder, syncDataTimestamp);
-            if (syncedMessages != nullptr) {
-                syncedMessages->push_back(local);
-            }
+            toInsert->addObject(remote->objectAtIndex(ii));
             remote->removeLastObject();
+            if ((int)toInsert->count() >= processor->insertBatchLimit()) {
+                flushInserts();
+            }
         }
+        flushInserts();
     }
 
-    // Step 5: Unlink. The messages left in local map are the ones we had in the range,
-    // which the server reported were no longer there. Remove their remoteUID.
+    // Step 5: Unlink. The local UIDs the server didn't return are the ones we had in the
+    // range, which the server reported were no longer there. Remove their remoteUID.
     // We'll delete them later if they don't appear in another folder during sync.
-    if (local.size() > 0) {
-        vector<uint32_t> deletedUIDs {};
-        for (auto const &ent : local) {
-            deletedUIDs.push_back(ent.first);
-        }
-        for (vector<uint32_t> chunk : MailUtils::chunksOfVector(deletedUIDs, 200)) {
-            auto query = Query().equal("remoteFolderId", folder.id()).equal("remoteUID", chunk);
-            processor->unlinkMessagesMatchingQuery(query, unlinkPhase);
+    vector<uint32_t> deletedUIDs{};
+    for (uint32_t uid : localUIDs) {
+        if (!remoteUIDs.contains(uid)) {
+            deletedUIDs.push_back(uid);
         }
     }
+    if (deletedUIDs.size() > 0) {
+        auto query = Query().equal("remoteFolderId", folder.id()).equal("remoteUID", deletedUIDs);
+        processor->unlinkMessagesMatchingQuery(query, unlinkPhase);
+    }
 }
 
 void SyncWorker::syncFolderChangesViaCondstore(Folder & folder, IMAPFolderStatus & remoteStatus, bool mustSyncAll)
@@ -832,21 +910,11 @@ void SyncWorker::syncFolderChangesViaCondstore(Folder & folder, IMAPFolderStatus
     logger->info("syncFolderChangesViaCondstore - Changes since HMODSEQ {}: {} changed, {} vanished",
                  modseq, modifiedOrAdded->count(), (vanished != nullptr) ? vanished->count() : 0);
 
-    for (unsigned int ii = 0; ii < modifiedOrAdded->count(); ii ++) {
-        IMAPMessage * msg = (IMAPMessage *)modifiedOrAdded->objectAtIndex(ii);
-        string id = MailUtils::idForMessage(folder.accountId(), folder.path(), msg);
-
-        Query query = Query().equal("id", id);
-        auto local = store->find<Message>(query);
-        
-        if (local == nullptr) {
-            // Found message with an ID we've never seen in any folder. Add it!
-            processor->insertFallbackToUpdateMessage(msg, folder, syncDataTimestamp);
-        } else {
-            // Found message with an existing ID. Update it's attributes & folderId.
-            // Note: Could potentially have moved from another folder!
-            processor->updateMessage(local.get(), msg, folder, syncDataTimestamp);
-        }
+    // Messages with an ID we've never seen in any folder are inserted. Messages with an
+    // existing ID have their attributes & folderId updated (they could potentially have
+    // moved from another folder!)
+    if (modifiedOrAdded->count() > 0) {
+        processor->insertMessages(modifiedOrAdded, folder, syncDataTimestamp);
     }
     
     // for deleted messages, collect UIDs and destroy. Note: vanishedMessages is only
@@ -874,6 +942,12 @@ void SyncWorker::cleanMessageCache(Folder & folder) {
     purge.bind(2, (double)(time(0) - maxAgeForBodySync(folder)));
     int purged = purge.exec();
     logger->info("-- {} message bodies deleted from local cache.", purged);
+
+    // drop queued messages that have aged out of the body sync window
+    SQLite::Statement expire(store->db(), "DELETE FROM PendingBody WHERE folderId = ? AND draft = 0 AND date < ?");
+    expire.bind(1, folder.id());
+    expire.bind(2, (double)(time(0) - maxAgeForBodySync(folder)));
+    expire.exec();
     // TODO BG: Remove them from the search index and remove attachments
 
     // update messages body stats
@@ -884,7 +958,7 @@ void SyncWorker::cleanMessageCache(Folder & folder) {
 // Message Body Sync
 
 time_t SyncWorker::maxAgeForBodySync(Folder & folder) {
-    return 24 * 60 * 60 * 30 * 3; // three months TODO pref!
+    return BODY_SYNC_MAX_AGE;
 }
 
 bool SyncWorker::shouldCacheBodiesInFolder(Folder & folder) {
@@ -895,10 +969,15 @@ bool SyncWorker::shouldCacheBodiesInFolder(Folder & folder) {
     return true;
 }
 
+// Note: FolderBodyCounts is maintained by triggers (see V11_SETUP_QUERIES), so
+// these are primary key lookups rather than scans of the folder's messages.
+
 long long SyncWorker::countBodiesDownloaded(Folder & folder) {
-    SQLite::Statement count(store->db(), "SELECT COUNT(Message.id) FROM Message INNER JOIN MessageBody ON MessageBody.id = Message.id WHERE MessageBody.value IS NOT NULL AND Message.remoteFolderId = ?");
+    SQLite::Statement count(store->db(), "SELECT present FROM FolderBodyCounts WHERE folderId = ?");
     count.bind(1, folder.id());
-    count.executeStep();
+    if (!count.executeStep()) {
+        return 0;
+    }
     return count.getColumn(0).getInt64();
 }
 
@@ -906,10 +985,12 @@ long long SyncWorker::countBodiesNeeded(Folder & folder) {
     if (!shouldCacheBodiesInFolder(folder)) {
         return 0;
     }
-    SQLite::Statement count(store->db(), "SELECT COUNT(Message.id) FROM Message WHERE Message.remoteFolderId = ? AND (Message.date > ? OR Message.draft = 1) AND Message.remoteUID > 0");
+    // the bodies we have plus the ones still queued for download
+    SQLite::Statement count(store->db(), "SELECT present + pending FROM FolderBodyCounts WHERE folderId = ?");
     count.bind(1, folder.id());
-    count.bind(2, (double)(time(0) - maxAgeForBodySync(folder)));
-    count.executeStep();
+    if (!count.executeStep()) {
+        return 0;
+    }
     return count.getColumn(0).getInt64();
 }
 
@@ -921,42 +1002,30 @@ bool SyncWorker::syncMessageBodies(Folder & folder, IMAPFolderStatus & remoteSta
         return false;
     }
 
-    vector<string> ids{};
     vector<shared_ptr<Message>> results{};
 
-    // very slow query = 400ms+
-    SQLite::Statement missing(store->db(), "SELECT Message.id, Message.remoteUID FROM Message LEFT JOIN MessageBody ON MessageBody.id = Message.id WHERE Message.accountId = ? AND Message.remoteFolderId = ? AND (Message.date > ? OR Message.draft = 1) AND Message.remoteUID > 0 AND MessageBody.id IS NULL ORDER BY Message.date DESC LIMIT 30");
-    missing.bind(1, folder.accountId());
-    missing.bind(2, folder.id());
-    missing.bind(3, (double)(time(0) - maxAgeForBodySync(folder))); // three months TODO pref!
-    while (missing.executeStep()) {
-        if (missing.getColumn(1).getUInt() >= UINT32_MAX - 2) {
-            continue; // message is scheduled for cleanup
-        }
-        ids.push_back(missing.getColumn(0).getString());
-    }
-    
-    SQLite::Statement stillMissing(store->db(), "SELECT Message.* FROM Message LEFT JOIN MessageBody ON MessageBody.id = Message.id WHERE Message.id IN (" + MailUtils::qmarks(ids.size()) + ") AND MessageBody.id IS NULL");
+    // The PendingBody queue holds the messages in the body sync window that have no body.
+    // Reading the next batch is an index scan, so we can do it within the transaction
+    // and dequeue the messages we take to ensure we don't process the same message twice.
+    SQLite::Statement next(store->db(), "SELECT Message.* FROM PendingBody INNER JOIN Message ON Message.id = PendingBody.id WHERE PendingBody.folderId = ? AND (PendingBody.date > ? OR PendingBody.draft = 1) AND Message.remoteUID > 0 AND Message.remoteUID < ? ORDER BY PendingBody.priority DESC, PendingBody.date DESC LIMIT 30");
+    SQLite::Statement dequeue(store->db(), "DELETE FROM PendingBody WHERE id = ?");
     SQLite::Statement insertPlaceholder(store->db(), "INSERT OR IGNORE INTO MessageBody (id, value) VALUES (?, ?)");
 
     {
         MailStoreTransaction transaction { store, "syncMessageBodies" };
 
-        // very fast query for the messages found during very slow query that still have no message body.
-        // Inserting empty message body reserves them for processing here. We do this within a transaction
-        // to ensure we don't process the same message twice.
-        int ii = 1;
-        for (auto id : ids) {
-            stillMissing.bind(ii++, id);
-        }
-        while (stillMissing.executeStep()) {
-            results.push_back(make_shared<Message>(stillMissing));
-        }
-        if (results.size() < ids.size()) {
-            logger->info("Body for {} messages already being fetched.", ids.size() - results.size());
+        next.bind(1, folder.id());
+        next.bind(2, (double)(time(0) - maxAgeForBodySync(folder)));
+        next.bind(3, (long long)(UINT32_MAX - 2)); // messages scheduled for cleanup
+        while (next.executeStep()) {
+            results.push_back(make_shared<Message>(next));
         }
 
         for (auto result : results) {
+            dequeue.bind(1, result->id());
+            dequeue.exec();
+            dequeue.reset();
+
             // write a blank entry into the MessageBody table so we'll only try to fetch each
             // message once. Otherwise a persistent ErrorFetch or crash for a single message
             // can cause the account to stay "syncing" forever.
@@ -969,17 +1038,8 @@ bool SyncWorker::syncMessageBodies(Folder & folder, IMAPFolderStatus & remoteSta
         transaction.commit();
     }
 
-    json & ls = folder.localStatus();
-    if (!ls.count(LS_BODIES_PRESENT) || !ls[LS_BODIES_PRESENT].is_number()) {
-        ls[LS_BODIES_PRESENT] = 0;
-    }
-    
     for (auto result : results) {
-        // increment local sync state - it's fine if this sometimes fails to save,
-        // we recompute the value via COUNT(*) during cleanup
-        ls[LS_BODIES_PRESENT] = ls[LS_BODIES_PRESENT].get<long long>() + 1;
-
-        // attempt to fetch the message boy
+        // attempt to fetch the message body
         syncMessageBody(result.get());
     }
     
@@ -65,12 +65,16 @@ public:
 
     void markAllFoldersBusy();
 
+    void idleMaintenance();
+
     std::vector<std::shared_ptr<Folder>> syncFoldersAndLabels();
 
 private:
     
     void ensureRootMailspringFolder(Array * remoteFolders);
 
+    void indexQueuedThreads(time_t queuedBefore);
+
     bool initialSyncFolderIncremental(Folder & folder, IMAPFolderStatus & remoteStatus);
         
     void syncFolderUIDRange(Folder & folder, Range range, bool heavyInitialRequest, vector<shared_ptr<Message>> * syncedMessages = nullptr);
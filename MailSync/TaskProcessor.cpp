@@ -679,24 +679,20 @@ void TaskProcessor::performLocalChangeOnMessages(Task * task, void (*modifyLocal
         for (auto & member : data["threadIds"]) {
             threadIds.push_back(member.get<string>());
         }
-        auto chunks = MailUtils::chunksOfVector(threadIds, 500);
-        auto allLabels = store->allLabelsCache(task->accountId());
+        auto allLabels = store->labelSnapshot(task->accountId());
+        auto threads = store->findAllMap<Thread>(Query().equal("id", threadIds), "id");
 
-        for (auto chunk : chunks) {
-            auto threads = store->findAllMap<Thread>(Query().equal("id", chunk), "id");
-
-            for (auto pair : threads) {
-                pair.second->resetCountedAttributes();
-            }
-            for (auto msg : models.messages) {
-                if (threads.count(msg->threadId())) {
-                    threads[msg->threadId()]->applyMessageAttributeChanges(MessageEmptySnapshot, msg.get(), allLabels);
-                }
-            }
-            for (auto pair : threads) {
-                store->save(pair.second.get());
+        for (auto pair : threads) {
+            pair.second->resetCountedAttributes();
+        }
+        for (auto msg : models.messages) {
+            if (threads.count(msg->threadId())) {
+                threads[msg->threadId()]->applyMessageAttributeChanges(MessageEmptySnapshot, msg.get(), *allLabels);
             }
         }
+        for (auto pair : threads) {
+            store->save(pair.second.get());
+        }
     }
     // END TEMPORARY
 
@@ -793,7 +789,7 @@ void TaskProcessor::performLocalSaveDraft(Task * task) {
             // INSERT or UPDATE. It's critical we bump the version of `existing`.
             int existingVersion = existing->version();
             existing->_data = draft._data;
-            existing->_data["v"] = existingVersion + 1;
+            existing->setVersion(existingVersion + 1);
             store->save(existing.get());
         } else {
             store->save(&draft);
@@ -802,8 +798,12 @@ void TaskProcessor::performLocalSaveDraft(Task * task) {
         if (draftJSON.count("body")) {
             SQLite::Statement insert(store->db(), "REPLACE INTO MessageBody (id, value) VALUES (?, ?)");
             insert.bind(1, draft.id());
-            insert.bind(2, draftJSON["body"].get<string>());
+            store->bindBody(insert, 2, draftJSON["body"].get<string>());
             insert.exec();
+
+            SQLite::Statement dequeue(store->db(), "DELETE FROM PendingBody WHERE id = ?");
+            dequeue.bind(1, draft.id());
+            dequeue.exec();
         }
         transaction.commit();
     }
@@ -0,0 +1,161 @@
+//
+//  UIDBitmap.cpp
+//  MailSync
+//
+//  Created by agent on 10/17/26.
+//  Copyright © 2026 Foundry 376. All rights reserved.
+//
+//  Use of this file is subject to the terms and conditions defined
+//  in 'LICENSE.md', which is part of the Mailspring-Sync package.
+//
+
+#include "UIDBitmap.hpp"
+
+#include <algorithm>
+
+#pragma mark Container
+
+bool UIDBitmap::Container::contains(uint16_t low) const {
+    if (bits.size()) {
+        return (bits[low >> 6] >> (low & 63)) & 1;
+    }
+    return binary_search(array.begin(), array.end(), low);
+}
+
+bool UIDBitmap::Container::add(uint16_t low) {
+    if (bits.size()) {
+        uint64_t mask = (uint64_t)1 << (low & 63);
+        if (bits[low >> 6] & mask) {
+            return false;
+        }
+        bits[low >> 6] |= mask;
+        cardinality += 1;
+        return true;
+    }
+
+    auto it = lower_bound(array.begin(), array.end(), low);
+    if (it != array.end() && *it == low) {
+        return false;
+    }
+    array.insert(it, low);
+    cardinality += 1;
+
+    if (array.size() > UID_BITMAP_ARRAY_MAX) {
+        bits = vector<uint64_t>(1024, 0);
+        for (uint16_t v : array) {
+            bits[v >> 6] |= (uint64_t)1 << (v & 63);
+        }
+        vector<uint16_t>().swap(array);
+    }
+    return true;
+}
+
+bool UIDBitmap::Container::remove(uint16_t low) {
+    if (bits.size()) {
+        uint64_t mask = (uint64_t)1 << (low & 63);
+        if (!(bits[low >> 6] & mask)) {
+            return false;
+        }
+        bits[low >> 6] &= ~mask;
+        cardinality -= 1;
+
+        if (cardinality <= UID_BITMAP_ARRAY_MAX / 2) {
+            array.reserve(cardinality);
+            for (uint32_t v = 0; v < 65536; v ++) {
+                if ((bits[v >> 6] >> (v & 63)) & 1) {
+                    array.push_back((uint16_t)v);
+                }
+            }
+            vector<uint64_t>().swap(bits);
+        }
+        return true;
+    }
+
+    auto it = lower_bound(array.begin(), array.end(), low);
+    if (it == array.end() || *it != low) {
+        return false;
+    }
+    array.erase(it);
+    cardinality -= 1;
+    return true;
+}
+
+#pragma mark UIDBitmap
+
+UIDBitmap::UIDBitmap() :
+    _cardinality(0)
+{
+}
+
+bool UIDBitmap::contains(uint32_t uid) const {
+    auto it = _containers.find((uint16_t)(uid >> 16));
+    if (it == _containers.end()) {
+        return false;
+    }
+    return it->second.contains((uint16_t)(uid & 0xFFFF));
+}
+
+void UIDBitmap::add(uint32_t uid) {
+    if (_containers[(uint16_t)(uid >> 16)].add((uint16_t)(uid & 0xFFFF))) {
+        _cardinality += 1;
+    }
+}
+
+void UIDBitmap::remove(uint32_t uid) {
+    auto it = _containers.find((uint16_t)(uid >> 16));
+    if (it == _containers.end()) {
+        return;
+    }
+    if (it->second.remove((uint16_t)(uid & 0xFFFF))) {
+        _cardinality -= 1;
+    }
+    if (it->second.cardinality == 0) {
+        _containers.erase(it);
+    }
+}
+
+size_t UIDBitmap::cardinality() const {
+    return _cardinality;
+}
+
+bool UIDBitmap::empty() const {
+    return _cardinality == 0;
+}
+
+vector<uint32_t> UIDBitmap::uidsInRange(uint32_t min, uint32_t max) const {
+    vector<uint32_t> results{};
+    if (min > max) {
+        return results;
+    }
+    for (auto it = _containers.lower_bound((uint16_t)(min >> 16)); it != _containers.end(); it++) {
+        uint32_t high = (uint32_t)it->first << 16;
+        if (high > max) {
+            break;
+        }
+        const Container & c = it->second;
+        if (c.bits.size()) {
+            for (uint32_t word = 0; word < 1024; word ++) {
+                uint64_t w = c.bits[word];
+                while (w) {
+                    uint32_t bit = 0;
+                    while (!((w >> bit) & 1)) {
+                        bit ++;
+                    }
+                    w &= ~((uint64_t)1 << bit);
+                    uint32_t uid = high | (word << 6) | bit;
+                    if (uid >= min && uid <= max) {
+                        results.push_back(uid);
+                    }
+                }
+            }
+        } else {
+            for (uint16_t low : c.array) {
+                uint32_t uid = high | low;
+                if (uid >= min && uid <= max) {
+                    results.push_back(uid);
+                }
+            }
+        }
+    }
+    return results;
+}
@@ -0,0 +1,58 @@
+//
+//  UIDBitmap.hpp
+//  MailSync
+//
+//  Created by agent on 10/17/26.
+//  Copyright © 2026 Foundry 376. All rights reserved.
+//
+//  Use of this file is subject to the terms and conditions defined
+//  in 'LICENSE.md', which is part of the Mailspring-Sync package.
+//
+
+#ifndef UIDBitmap_hpp
+#define UIDBitmap_hpp
+
+#include <stdio.h>
+#include <stdint.h>
+#include <map>
+#include <vector>
+
+using namespace std;
+
+/*
+ A compressed set of IMAP UIDs, in the style of a roaring bitmap. UIDs are
+ grouped by their high 16 bits. Each group stores its low 16 bits as a sorted
+ array while sparse and switches to a 65536-bit bitmap once it holds more than
+ UID_BITMAP_ARRAY_MAX values, so a dense folder costs ~1 bit per UID.
+ */
+#define UID_BITMAP_ARRAY_MAX 4096
+
+class UIDBitmap {
+    struct Container {
+        vector<uint16_t> array;
+        vector<uint64_t> bits;
+        uint32_t cardinality = 0;
+
+        bool contains(uint16_t low) const;
+        bool add(uint16_t low);
+        bool remove(uint16_t low);
+    };
+
+    map<uint16_t, Container> _containers;
+    size_t _cardinality;
+
+public:
+    UIDBitmap();
+
+    bool contains(uint32_t uid) const;
+    void add(uint32_t uid);
+    void remove(uint32_t uid);
+
+    size_t cardinality() const;
+    bool empty() const;
+
+    // returns the UIDs in [min, max] in ascending order
+    vector<uint32_t> uidsInRange(uint32_t min, uint32_t max) const;
+};
+
+#endif /* UIDBitmap_hpp */
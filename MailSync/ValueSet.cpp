@@ -0,0 +1,250 @@
+//
+//  ValueSet.cpp
+//  MailSync
+//
+//  Created by agent on 10/17/26.
+//  Copyright © 2026 Foundry 376. All rights reserved.
+//
+//  Use of this file is subject to the terms and conditions defined
+//  in 'LICENSE.md', which is part of the Mailspring-Sync package.
+//
+
+#include <sqlite3.h>
+#include "ValueSet.hpp"
+#include "SyncException.hpp"
+
+#include <string.h>
+
+#define VALUE_SET_INTEGER 'i'
+#define VALUE_SET_REAL 'r'
+#define VALUE_SET_TEXT 't'
+
+#pragma mark Packing
+
+ValueSet::ValueSet() : _packed(""), _count(0) {
+}
+
+ValueSet::ValueSet(const vector<string> & values) : ValueSet() {
+    for (const auto & value : values) {
+        add(value);
+    }
+}
+
+ValueSet::ValueSet(const vector<uint32_t> & values) : ValueSet() {
+    _packed.reserve(values.size() * 9);
+    for (uint32_t value : values) {
+        add((int64_t)value);
+    }
+}
+
+ValueSet::ValueSet(const json & values) : ValueSet() {
+    for (const auto & value : values) {
+        if (value.is_number_integer()) {
+            add(value.get<int64_t>());
+        } else if (value.is_number()) {
+            add(value.get<double>());
+        } else if (value.is_string()) {
+            add(value.get<string>());
+        } else {
+            throw SyncException("query-builder", "Unsure of how to bind json to sqlite", true);
+        }
+    }
+}
+
+static void appendLE(string & packed, uint64_t value, int bytes) {
+    for (int ii = 0; ii < bytes; ii ++) {
+        packed.push_back((char)((value >> (ii * 8)) & 0xFF));
+    }
+}
+
+static uint64_t readLE(const unsigned char * p, int bytes) {
+    uint64_t value = 0;
+    for (int ii = 0; ii < bytes; ii ++) {
+        value |= (uint64_t)p[ii] << (ii * 8);
+    }
+    return value;
+}
+
+void ValueSet::add(const string & value) {
+    _packed.push_back(VALUE_SET_TEXT);
+    appendLE(_packed, value.size(), 4);
+    _packed.append(value);
+    _count += 1;
+}
+
+void ValueSet::add(int64_t value) {
+    _packed.push_back(VALUE_SET_INTEGER);
+    appendLE(_packed, (uint64_t)value, 8);
+    _count += 1;
+}
+
+void ValueSet::add(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, 8);
+    _packed.push_back(VALUE_SET_REAL);
+    appendLE(_packed, bits, 8);
+    _count += 1;
+}
+
+size_t ValueSet::size() const {
+    return _count;
+}
+
+void ValueSet::bind(SQLite::Statement & query, int index) const {
+    // an empty blob (rather than NULL) so the set is empty rather than unconstrained
+    query.bind(index, (const void *)_packed.data(), (int)_packed.size());
+}
+
+#pragma mark mailsync_set
+
+/*
+ An eponymous-only virtual table with a `value` column and a hidden `packed`
+ column that receives the function argument. Without the argument it's empty.
+ */
+struct ValueSetCursor {
+    sqlite3_vtab_cursor base;
+    string packed;
+    size_t offset;
+    size_t next;
+    sqlite3_int64 rowid;
+};
+
+static size_t valueSetEntryLength(const string & packed, size_t offset) {
+    if (offset >= packed.size()) {
+        return 0;
+    }
+    const unsigned char * p = (const unsigned char *)packed.data() + offset;
+    size_t available = packed.size() - offset;
+    size_t length = 0;
+    if (p[0] == VALUE_SET_TEXT && available >= 5) {
+        length = 5 + (size_t)readLE(p + 1, 4);
+    } else if (p[0] == VALUE_SET_INTEGER || p[0] == VALUE_SET_REAL) {
+        length = 9;
+    }
+    // treat a malformed entry as the end of the set
+    return length <= available ? length : 0;
+}
+
+static int valueSetConnect(sqlite3 * db, void * aux, int argc, const char * const * argv, sqlite3_vtab ** ppVtab, char ** pzErr) {
+    int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(value, packed HIDDEN)");
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    sqlite3_vtab * vtab = (sqlite3_vtab *)sqlite3_malloc(sizeof(sqlite3_vtab));
+    if (!vtab) {
+        return SQLITE_NOMEM;
+    }
+    memset(vtab, 0, sizeof(sqlite3_vtab));
+    *ppVtab = vtab;
+    return SQLITE_OK;
+}
+
+static int valueSetDisconnect(sqlite3_vtab * vtab) {
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
+
+static int valueSetBestIndex(sqlite3_vtab * vtab, sqlite3_index_info * info) {
+    for (int ii = 0; ii < info->nConstraint; ii ++) {
+        auto & c = info->aConstraint[ii];
+        if (c.usable && c.iColumn == 1 && c.op == SQLITE_INDEX_CONSTRAINT_EQ) {
+            info->aConstraintUsage[ii].argvIndex = 1;
+            info->aConstraintUsage[ii].omit = 1;
+            info->idxNum = 1;
+            info->estimatedCost = 10;
+            info->estimatedRows = 100;
+            return SQLITE_OK;
+        }
+    }
+    info->idxNum = 0;
+    info->estimatedCost = 1e12;
+    info->estimatedRows = 1;
+    return SQLITE_OK;
+}
+
+static int valueSetOpen(sqlite3_vtab * vtab, sqlite3_vtab_cursor ** ppCursor) {
+    *ppCursor = &(new ValueSetCursor())->base;
+    return SQLITE_OK;
+}
+
+static int valueSetClose(sqlite3_vtab_cursor * cursor) {
+    delete (ValueSetCursor *)cursor;
+    return SQLITE_OK;
+}
+
+static int valueSetFilter(sqlite3_vtab_cursor * cursor, int idxNum, const char * idxStr, int argc, sqlite3_value ** argv) {
+    ValueSetCursor * c = (ValueSetCursor *)cursor;
+    c->packed = "";
+    if (idxNum == 1 && argc == 1) {
+        const char * bytes = (const char *)sqlite3_value_blob(argv[0]);
+        int length = sqlite3_value_bytes(argv[0]);
+        if (bytes && length > 0) {
+            c->packed = string(bytes, length);
+        }
+    }
+    c->offset = 0;
+    c->next = valueSetEntryLength(c->packed, 0);
+    c->rowid = 1;
+    return SQLITE_OK;
+}
+
+static int valueSetNext(sqlite3_vtab_cursor * cursor) {
+    ValueSetCursor * c = (ValueSetCursor *)cursor;
+    c->offset += c->next;
+    c->next = valueSetEntryLength(c->packed, c->offset);
+    c->rowid += 1;
+    return SQLITE_OK;
+}
+
+static int valueSetEof(sqlite3_vtab_cursor * cursor) {
+    ValueSetCursor * c = (ValueSetCursor *)cursor;
+    return c->next == 0;
+}
+
+static int valueSetColumn(sqlite3_vtab_cursor * cursor, sqlite3_context * context, int column) {
+    ValueSetCursor * c = (ValueSetCursor *)cursor;
+    if (column == 1) {
+        sqlite3_result_blob(context, c->packed.data(), (int)c->packed.size(), SQLITE_TRANSIENT);
+        return SQLITE_OK;
+    }
+    const unsigned char * p = (const unsigned char *)c->packed.data() + c->offset;
+    if (p[0] == VALUE_SET_TEXT) {
+        sqlite3_result_text(context, (const char *)p + 5, (int)(c->next - 5), SQLITE_TRANSIENT);
+    } else if (p[0] == VALUE_SET_INTEGER) {
+        sqlite3_result_int64(context, (sqlite3_int64)readLE(p + 1, 8));
+    } else {
+        uint64_t bits = readLE(p + 1, 8);
+        double value;
+        memcpy(&value, &bits, 8);
+        sqlite3_result_double(context, value);
+    }
+    return SQLITE_OK;
+}
+
+static int valueSetRowid(sqlite3_vtab_cursor * cursor, sqlite3_int64 * pRowid) {
+    *pRowid = ((ValueSetCursor *)cursor)->rowid;
+    return SQLITE_OK;
+}
+
+static sqlite3_module valueSetModule = {
+    0,                      // iVersion
+    0,                      // xCreate - eponymous only
+    valueSetConnect,
+    valueSetBestIndex,
+    valueSetDisconnect,
+    0,                      // xDestroy
+    valueSetOpen,
+    valueSetClose,
+    valueSetFilter,
+    valueSetNext,
+    valueSetEof,
+    valueSetColumn,
+    valueSetRowid,
+};
+
+void ValueSet::registerModule(SQLite::Database & db) {
+    int rc = sqlite3_create_module(db.getHandle(), "mailsync_set", &valueSetModule, nullptr);
+    if (rc != SQLITE_OK) {
+        throw SQLite::Exception(db.getHandle(), rc);
+    }
+}
@@ -0,0 +1,60 @@
+//
+//  ValueSet.hpp
+//  MailSync
+//
+//  Created by agent on 10/17/26.
+//  Copyright © 2026 Foundry 376. All rights reserved.
+//
+//  Use of this file is subject to the terms and conditions defined
+//  in 'LICENSE.md', which is part of the Mailspring-Sync package.
+//
+
+#ifndef ValueSet_hpp
+#define ValueSet_hpp
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <SQLiteCpp/SQLiteCpp.h>
+
+#include "json.hpp"
+
+using namespace nlohmann;
+using namespace std;
+
+/*
+ Binds a set of values to a single statement parameter. The values are packed
+ into a blob and read back by the `mailsync_set` table-valued function, so
+ `col IN (SELECT value FROM mailsync_set(?))` can be prepared once and used
+ with sets of any size. (Our SQLite predates carray pointer binding and is
+ built without JSON1, so we provide the function ourselves.)
+
+ Each value is a type byte followed by a little-endian int64, a double, or a
+ 4-byte length and the UTF-8 text.
+ */
+#define VALUE_SET_SELECT "SELECT value FROM mailsync_set(?)"
+
+class ValueSet {
+    string _packed;
+    size_t _count;
+
+public:
+    static void registerModule(SQLite::Database & db);
+
+    ValueSet();
+    ValueSet(const vector<string> & values);
+    ValueSet(const vector<uint32_t> & values);
+    ValueSet(const json & values);
+
+    void add(const string & value);
+    void add(int64_t value);
+    void add(double value);
+
+    size_t size() const;
+
+    void bind(SQLite::Statement & query, int index) const;
+};
+
+#endif /* ValueSet_hpp */
@@ -27,16 +27,22 @@ static string MAILSPRING_FOLDER_PREFIX_V1 = "[Mailspring]";
 static string MAILSPRING_FOLDER_PREFIX_V2 = "Mailspring";
 
 static vector<string> ACCOUNT_RESET_QUERIES = {
+    "DELETE FROM `FolderBodyCounts` WHERE `folderId` IN (SELECT id FROM `Folder` WHERE `accountId` = ?)",
     "DELETE FROM `ThreadCounts` WHERE `categoryId` IN (SELECT id FROM `Folder` WHERE `accountId` = ?)",
     "DELETE FROM `ThreadCounts` WHERE `categoryId` IN (SELECT id FROM `Label` WHERE `accountId` = ?)",
     "DELETE FROM `ThreadCategory` WHERE `id` IN (SELECT id FROM `Thread` WHERE `accountId` = ?)",
-    "DELETE FROM `ThreadSearch` WHERE `content_id` IN (SELECT id FROM `Thread` WHERE `accountId` = ?)",
+    "INSERT INTO `ThreadSearch` (`ThreadSearch`, rowid, content_id, subject, to_, from_, categories, body) "
+        "SELECT 'delete', id, content_id, subject, to_, from_, categories, mailsync_body(body) FROM `ThreadSearchContent` "
+        "WHERE `content_id` IN (SELECT id FROM `Thread` WHERE `accountId` = ?)",
+    "DELETE FROM `ThreadSearchContent` WHERE `content_id` IN (SELECT id FROM `Thread` WHERE `accountId` = ?)",
+    "DELETE FROM `ThreadSearchQueue` WHERE `accountId` = ?",
     "DELETE FROM `ThreadReference` WHERE `accountId` = ?",
     "DELETE FROM `Thread` WHERE `accountId` = ?",
     "DELETE FROM `File` WHERE `accountId` = ?",
     "DELETE FROM `Event` WHERE `accountId` = ?",
     "DELETE FROM `Label` WHERE `accountId` = ?",
     "DELETE FROM `MessageBody` WHERE `id` IN (SELECT id FROM `Message` WHERE `accountId` = ?)",
+    "DELETE FROM `PendingBody` WHERE `accountId` = ?",
     "DELETE FROM `Message` WHERE `accountId` = ?",
     "DELETE FROM `Task` WHERE `accountId` = ?",
     "DELETE FROM `Folder` WHERE `accountId` = ?",
@@ -45,9 +51,57 @@ static vector<string> ACCOUNT_RESET_QUERIES = {
     "DELETE FROM `Calendar` WHERE `accountId` = ?",
     "DELETE FROM `ModelPluginMetadata` WHERE `accountId` = ?",
     "DELETE FROM `DetatchedPluginMetadata` WHERE `accountId` = ?",
+    "DELETE FROM `LabelDictionary` WHERE `accountId` = ?",
     "DELETE FROM `Account` WHERE `id` = ?",
 };
 
+// Copies an account's rows from the shared database (attached as `shared`) into
+// the account's own database file. See MailStore::moveAccountToDatabase.
+static vector<string> ACCOUNT_MOVE_QUERIES = {
+    "INSERT INTO main.`ThreadCounts` SELECT * FROM shared.`ThreadCounts` WHERE `categoryId` IN (SELECT id FROM shared.`Folder` WHERE `accountId` = ?)",
+    "INSERT INTO main.`ThreadCounts` SELECT * FROM shared.`ThreadCounts` WHERE `categoryId` IN (SELECT id FROM shared.`Label` WHERE `accountId` = ?)",
+    "INSERT INTO main.`ThreadCategory` SELECT * FROM shared.`ThreadCategory` WHERE `id` IN (SELECT id FROM shared.`Thread` WHERE `accountId` = ?)",
+    "INSERT INTO main.`ThreadSearchContent` SELECT * FROM shared.`ThreadSearchContent` WHERE `content_id` IN (SELECT id FROM shared.`Thread` WHERE `accountId` = ?)",
+    "INSERT INTO main.`ThreadSearchQueue` SELECT * FROM shared.`ThreadSearchQueue` WHERE `accountId` = ?",
+    "INSERT INTO main.`ThreadReference` SELECT * FROM shared.`ThreadReference` WHERE `accountId` = ?",
+    "INSERT INTO main.`Thread` SELECT * FROM shared.`Thread` WHERE `accountId` = ?",
+    "INSERT INTO main.`File` SELECT * FROM shared.`File` WHERE `accountId` = ?",
+    "INSERT INTO main.`Event` SELECT * FROM shared.`Event` WHERE `accountId` = ?",
+    "INSERT INTO main.`Label` SELECT * FROM shared.`Label` WHERE `accountId` = ?",
+    "INSERT INTO main.`MessageBody` SELECT * FROM shared.`MessageBody` WHERE `id` IN (SELECT id FROM shared.`Message` WHERE `accountId` = ?)",
+    "INSERT INTO main.`PendingBody` SELECT * FROM shared.`PendingBody` WHERE `accountId` = ?",
+    "INSERT INTO main.`Message` SELECT * FROM shared.`Message` WHERE `accountId` = ?",
+    "INSERT INTO main.`Task` SELECT * FROM shared.`Task` WHERE `accountId` = ?",
+    "INSERT INTO main.`Folder` SELECT * FROM shared.`Folder` WHERE `accountId` = ?",
+    "INSERT INTO main.`ContactSearch` SELECT * FROM shared.`ContactSearch` WHERE `content_id` IN (SELECT id FROM shared.`Contact` WHERE `accountId` = ?)",
+    "INSERT INTO main.`Contact` SELECT * FROM shared.`Contact` WHERE `accountId` = ?",
+    "INSERT INTO main.`Calendar` SELECT * FROM shared.`Calendar` WHERE `accountId` = ?",
+    "INSERT INTO main.`ModelPluginMetadata` SELECT * FROM shared.`ModelPluginMetadata` WHERE `accountId` = ?",
+    "INSERT INTO main.`DetatchedPluginMetadata` SELECT * FROM shared.`DetatchedPluginMetadata` WHERE `accountId` = ?",
+    "INSERT INTO main.`LabelDictionary` SELECT * FROM shared.`LabelDictionary` WHERE `accountId` = ?",
+    "INSERT INTO main.`EventSearch` SELECT * FROM shared.`EventSearch` WHERE `content_id` IN (SELECT id FROM shared.`Event` WHERE `accountId` = ?)",
+    "INSERT INTO main.`ContactContactGroup` SELECT * FROM shared.`ContactContactGroup` WHERE `value` IN (SELECT id FROM shared.`ContactGroup` WHERE `accountId` = ?)",
+    "INSERT INTO main.`ContactGroup` SELECT * FROM shared.`ContactGroup` WHERE `accountId` = ?",
+    "INSERT INTO main.`ContactBook` SELECT * FROM shared.`ContactBook` WHERE `accountId` = ?",
+    "INSERT INTO main.`Account` SELECT * FROM shared.`Account` WHERE `id` = ?",
+};
+
+// Removes the rows ACCOUNT_RESET_QUERIES leaves behind from the shared database once an
+// account has been moved. Run before ACCOUNT_RESET_QUERIES, which deletes the Events.
+static vector<string> ACCOUNT_MOVE_DELETE_QUERIES = {
+    "DELETE FROM `EventSearch` WHERE `content_id` IN (SELECT id FROM `Event` WHERE `accountId` = ?)",
+    "DELETE FROM `ContactContactGroup` WHERE `value` IN (SELECT id FROM `ContactGroup` WHERE `accountId` = ?)",
+    "DELETE FROM `ContactGroup` WHERE `accountId` = ?",
+    "DELETE FROM `ContactBook` WHERE `accountId` = ?",
+};
+
+// Tables combined across account database files by MailStore::accountDatabasesSQL
+static vector<string> ACCOUNT_VIEW_TABLES = {
+    "Account", "Folder", "Label", "Thread", "ThreadCategory", "ThreadCounts", "ThreadReference",
+    "Message", "MessageBody", "File", "Event", "Calendar", "Contact", "ContactGroup",
+    "ContactContactGroup", "ContactBook", "Task", "ModelPluginMetadata", "DetatchedPluginMetadata",
+};
+
 static vector<string> V1_SETUP_QUERIES = {
     "CREATE TABLE IF NOT EXISTS `_State` (id VARCHAR(40) PRIMARY KEY, value TEXT)",
 
@@ -213,6 +267,103 @@ static vector<string> V8_SETUP_QUERIES = {
     "CREATE TABLE `ContactBook` (`id` varchar(40),`accountId` varchar(40), `data` BLOB, `version` INTEGER, PRIMARY KEY (id));",
 };
 
+static vector<string> V9_SETUP_QUERIES = {
+    "CREATE TABLE IF NOT EXISTS `LabelDictionary` (accountId VARCHAR(8), value TEXT, idx INTEGER, PRIMARY KEY (accountId, value))",
+    "ALTER TABLE `Message` ADD COLUMN remoteXGMLabelIds BLOB",
+    // messages without labels can be converted here, the others by MailStore::migrateLabelIds
+    "UPDATE `Message` SET remoteXGMLabelIds = X'' WHERE remoteXGMLabels = '[]'",
+};
+
+static vector<string> V10_SETUP_QUERIES = {
+    "CREATE TABLE IF NOT EXISTS `PendingBody` (id VARCHAR(40) PRIMARY KEY, accountId VARCHAR(8), folderId VARCHAR(40), draft INTEGER, priority INTEGER, date INTEGER)",
+    "CREATE INDEX IF NOT EXISTS PendingBodyQueueIndex ON PendingBody(folderId, priority DESC, date DESC)",
+    // queue the messages the body sync would have found with a LEFT JOIN. See Message::pendingBodyPriority
+    "INSERT OR IGNORE INTO `PendingBody` (id, accountId, folderId, draft, priority, date) "
+        "SELECT Message.id, Message.accountId, Message.remoteFolderId, Message.draft, "
+        "(Message.draft * 4) + (CASE Folder.role WHEN 'inbox' THEN 2 WHEN 'sent' THEN 1 WHEN 'drafts' THEN 1 ELSE 0 END), Message.date "
+        "FROM Message LEFT JOIN MessageBody ON MessageBody.id = Message.id LEFT JOIN Folder ON Folder.id = Message.remoteFolderId "
+        "WHERE MessageBody.id IS NULL AND Message.remoteUID > 0 AND Message.remoteUID < 4294967293 "
+        "AND (Message.date > CAST(strftime('%s', 'now', '-90 days') AS INTEGER) OR Message.draft = 1) "
+        "AND IFNULL(Folder.role, '') NOT IN ('spam', 'trash')",
+};
+
+// Per-folder body sync progress. `present` counts messages in the folder with a body,
+// `pending` counts messages in the folder queued in PendingBody. Both are kept current
+// by the triggers below, so reading them doesn't require scanning the folder. Note: the
+// triggers rely on `recursive_triggers` so rows removed by REPLACE are counted.
+static vector<string> V11_SETUP_QUERIES = {
+    "CREATE TABLE IF NOT EXISTS `FolderBodyCounts` (folderId VARCHAR(40) PRIMARY KEY, present INTEGER DEFAULT 0, pending INTEGER DEFAULT 0)",
+
+    "CREATE TRIGGER IF NOT EXISTS FolderBodyCountsFolderInsert AFTER INSERT ON Folder BEGIN "
+        "INSERT OR IGNORE INTO FolderBodyCounts (folderId, present, pending) VALUES (NEW.id, 0, 0); END",
+    "CREATE TRIGGER IF NOT EXISTS FolderBodyCountsFolderDelete AFTER DELETE ON Folder BEGIN "
+        "DELETE FROM FolderBodyCounts WHERE folderId = OLD.id; END",
+
+    "CREATE TRIGGER IF NOT EXISTS FolderBodyCountsBodyInsert AFTER INSERT ON MessageBody WHEN NEW.value IS NOT NULL BEGIN "
+        "UPDATE FolderBodyCounts SET present = present + 1 WHERE folderId = (SELECT remoteFolderId FROM Message WHERE id = NEW.id); END",
+    "CREATE TRIGGER IF NOT EXISTS FolderBodyCountsBodyUpdate AFTER UPDATE OF value ON MessageBody WHEN (OLD.value IS NULL) != (NEW.value IS NULL) BEGIN "
+        "UPDATE FolderBodyCounts SET present = present + (CASE WHEN NEW.value IS NULL THEN -1 ELSE 1 END) WHERE folderId = (SELECT remoteFolderId FROM Message WHERE id = NEW.id); END",
+    "CREATE TRIGGER IF NOT EXISTS FolderBodyCountsBodyDelete AFTER DELETE ON MessageBody WHEN OLD.value IS NOT NULL BEGIN "
+        "UPDATE FolderBodyCounts SET present = present - 1 WHERE folderId = (SELECT remoteFolderId FROM Message WHERE id = OLD.id); END",
+
+    "CREATE TRIGGER IF NOT EXISTS FolderBodyCountsMessageInsert AFTER INSERT ON Message "
+        "WHEN EXISTS (SELECT 1 FROM MessageBody WHERE id = NEW.id AND value IS NOT NULL) BEGIN "
+        "UPDATE FolderBodyCounts SET present = present + 1 WHERE folderId = NEW.remoteFolderId; END",
+    "CREATE TRIGGER IF NOT EXISTS FolderBodyCountsMessageMove AFTER UPDATE OF remoteFolderId ON Message "
+        "WHEN OLD.remoteFolderId IS NOT NEW.remoteFolderId AND EXISTS (SELECT 1 FROM MessageBody WHERE id = NEW.id AND value IS NOT NULL) BEGIN "
+        "UPDATE FolderBodyCounts SET present = present - 1 WHERE folderId = OLD.remoteFolderId; "
+        "UPDATE FolderBodyCounts SET present = present + 1 WHERE folderId = NEW.remoteFolderId; END",
+    "CREATE TRIGGER IF NOT EXISTS FolderBodyCountsMessageDelete AFTER DELETE ON Message "
+        "WHEN EXISTS (SELECT 1 FROM MessageBody WHERE id = OLD.id AND value IS NOT NULL) BEGIN "
+        "UPDATE FolderBodyCounts SET present = present - 1 WHERE folderId = OLD.remoteFolderId; END",
+
+    "CREATE TRIGGER IF NOT EXISTS FolderBodyCountsPendingInsert AFTER INSERT ON PendingBody BEGIN "
+        "UPDATE FolderBodyCounts SET pending = pending + 1 WHERE folderId = NEW.folderId; END",
+    "CREATE TRIGGER IF NOT EXISTS FolderBodyCountsPendingDelete AFTER DELETE ON PendingBody BEGIN "
+        "UPDATE FolderBodyCounts SET pending = pending - 1 WHERE folderId = OLD.folderId; END",
+};
+
+// Threads whose ThreadSearch row must be rebuilt from their messages. Ingest queues
+// threads here rather than rewriting the row - see MailProcessor::indexQueuedThreads.
+static vector<string> V12_SETUP_QUERIES = {
+    "CREATE TABLE IF NOT EXISTS `ThreadSearchQueue` (threadId VARCHAR(40) PRIMARY KEY, accountId VARCHAR(8), queuedAt INTEGER)",
+    "CREATE INDEX IF NOT EXISTS ThreadSearchQueueIndex ON ThreadSearchQueue(accountId, queuedAt)",
+};
+
+// Indexes every row of ThreadSearchContent. FTS5 can't see compressed bodies through
+// ThreadSearchSource, so the 'rebuild' command can't be used for this.
+static string THREAD_SEARCH_REINDEX_QUERY =
+    "INSERT INTO `ThreadSearch` (rowid, content_id, subject, to_, from_, categories, body) "
+    "SELECT id, content_id, subject, to_, from_, categories, mailsync_body(body) FROM `ThreadSearchContent`";
+
+// ThreadSearch becomes an external-content FTS5 table, so the index no longer keeps
+// its own copy of the text. The text lives in ThreadSearchContent, where the body is
+// compressed if the store opts in (see MailStore::migrateBodyEncoding). ThreadSearchSource
+// exposes it to FTS5, and to clients' snippet() and highlight() calls. No function can
+// decode a compressed body on clients' connections, so the view shows those as empty.
+// See MailStore::updateThreadSearch.
+static vector<string> V13_SETUP_QUERIES = {
+    "CREATE TABLE IF NOT EXISTS `ThreadSearchContent` (id INTEGER PRIMARY KEY, content_id VARCHAR(40), subject TEXT, to_ TEXT, from_ TEXT, categories TEXT, body BLOB)",
+    "CREATE INDEX IF NOT EXISTS ThreadSearchContentIdIndex ON ThreadSearchContent(content_id)",
+    "INSERT INTO `ThreadSearchContent` (id, content_id, subject, to_, from_, categories, body) "
+        "SELECT rowid, content_id, subject, to_, from_, categories, body FROM `ThreadSearch`",
+    "DROP TABLE `ThreadSearch`",
+    "CREATE VIEW IF NOT EXISTS `ThreadSearchSource` AS SELECT id, content_id, subject, to_, from_, categories, "
+        "CASE WHEN typeof(body) = 'blob' THEN '' ELSE body END AS body FROM `ThreadSearchContent`",
+    "CREATE VIRTUAL TABLE IF NOT EXISTS `ThreadSearch` USING fts5(tokenize = 'porter unicode61', content_id UNINDEXED, subject, to_, from_, categories, body, content = 'ThreadSearchSource', content_rowid = 'id')",
+    THREAD_SEARCH_REINDEX_QUERY,
+};
+
+// Recomputes FolderBodyCounts from scratch. Run after migrations, which may change
+// the underlying tables without firing the triggers above.
+static vector<string> FOLDER_BODY_COUNTS_REPAIR_QUERIES = {
+    "DELETE FROM `FolderBodyCounts`",
+    "INSERT INTO `FolderBodyCounts` (folderId, present, pending) SELECT Folder.id, "
+        "(SELECT COUNT(Message.id) FROM Message INNER JOIN MessageBody ON MessageBody.id = Message.id WHERE Message.remoteFolderId = Folder.id AND MessageBody.value IS NOT NULL), "
+        "(SELECT COUNT(PendingBody.id) FROM PendingBody WHERE PendingBody.folderId = Folder.id) "
+        "FROM Folder",
+};
+
 
 static map<string, string> COMMON_FOLDER_NAMES = {
     {"gel\xc3\xb6scht", "trash"},
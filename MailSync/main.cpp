@@ -31,6 +31,7 @@
 #include "Identity.hpp"
 #include "MailUtils.hpp"
 #include "MailStore.hpp"
+#include "MailProcessor.hpp"
 #include "DeltaStream.hpp"
 #include "SyncWorker.hpp"
 #include "MetadataWorker.hpp"
@@ -129,7 +130,7 @@ const option::Descriptor usage[] =
     {HELP,    0,"" , "help",    CArg::None,      "  --help  \tPrint usage and exit." },
     {IDENTITY,0,"a", "identity",CArg::Optional,  USAGE_IDENTITY },
     {ACCOUNT, 0,"a", "account", CArg::Optional,  "  --account, -a  \tRequired: Account JSON with credentials." },
-    {MODE,    0,"m", "mode",    CArg::Required,  "  --mode, -m  \tRequired: sync, test, reset, calendar, or migrate." },
+    {MODE,    0,"m", "mode",    CArg::Required,  "  --mode, -m  \tRequired: sync, test, reset, calendar, migrate, migrate-data-json, migrate-bodies-compressed, migrate-bodies-text or move-account-database." },
     {ORPHAN,  0,"o", "orphan",  CArg::None,      "  --orphan, -o  \tOptional: allow the process to run without a parent bound to stdin." },
     {VERBOSE, 0,"v", "verbose", CArg::None,      "  --verbose, -v  \tOptional: log all IMAP and SMTP traffic for debugging purposes." },
     {0,0,0,0,0,0}
@@ -202,6 +203,9 @@ void runBackgroundSyncWorker() {
             }
             SharedDeltaStream()->endConnectionError(bgWorker->account->id());
 
+            // we're caught up - do database upkeep before sleeping
+            bgWorker->idleMaintenance();
+
         } catch (SyncException & ex) {
             exceptions::logCurrentExceptionWithStackTrace();
             if (!ex.isRetryable()) {
@@ -471,6 +475,16 @@ void runListenOnMainThread(shared_ptr<Account> account) {
                 if (fgWorker) fgWorker->idleInterrupt();
             }
 
+            if (type == "flush-search-index") {
+                // the client is about to run a search - index any threads the
+                // background worker hasn't gotten to yet so results are complete
+                // Only threads queued before now - sync keeps queueing more while we work.
+                MailProcessor searchProcessor{account, &store};
+                time_t queuedBefore = time(0);
+                while (searchProcessor.indexQueuedThreads(THREAD_SEARCH_INDEX_BATCH, queuedBefore) > 0) {
+                }
+            }
+
             if (type == "need-bodies") {
                 // interrupt the foreground sync worker to do the remote part of the task
                 vector<string> ids{};
@@ -565,6 +579,31 @@ string exectuablePath = argv[0];
         return runSingleFunctionAndExit([](){
             MailStore store;
             store.migrate();
+
+            // the SQL the client runs to read moved accounts names each table's columns
+            auto accountIds = store.accountDatabaseIds();
+            if (accountIds.size() > 0) {
+                store.saveAccountDatabases(accountIds);
+            }
+        });
+    }
+
+    // Convert Message and Thread data stored as CBOR by earlier builds back to JSON.
+    if (mode == "migrate-data-json") {
+        return runSingleFunctionAndExit([&](){
+            MailStore store;
+            store.migrate();
+            store.migrateDataToJSON();
+        });
+    }
+
+    // Opt in to (or back out of) compressing message and thread search bodies. Readers
+    // outside mailsync must inflate BodyCodec blobs themselves - see BodyCodec.hpp.
+    if (mode == "migrate-bodies-compressed" || mode == "migrate-bodies-text") {
+        return runSingleFunctionAndExit([&](){
+            MailStore store;
+            store.migrate();
+            store.migrateBodyEncoding(mode == "migrate-bodies-compressed");
         });
     }
 
@@ -593,13 +632,42 @@ string exectuablePath = argv[0];
 		return 1;
 	}
     
+    // Accounts moved to their own database file open it instead of the shared one.
+    // The client only runs --mode migrate on the shared database, so migrate it here.
+    if (MailStore::accountDatabaseExists(account->id())) {
+        MailStore::accountDatabaseId = account->id();
+        try {
+            MailStore store;
+            store.migrate();
+        } catch (std::exception & ex) {
+            json resp = { { "error", "Account database migration failed: " + string(ex.what()) } };
+            cout << "\n" << resp.dump();
+            return 1;
+        }
+    }
+
     if (mode == "reset") {
         return runSingleFunctionAndExit([&](){
+            if (MailStore::accountDatabaseId != "") {
+                // replace the account's database file with an empty one
+                MailStore::removeAccountDatabase(account->id());
+                MailStore store;
+                store.migrate();
+                return;
+            }
             MailStore store;
             store.resetForAccount(account->id());
         });
     }
 
+    if (mode == "move-account-database") {
+        return runSingleFunctionAndExit([&](){
+            MailStore store;
+            store.migrate();
+            store.moveAccountToDatabase(account->id());
+        });
+    }
+
 	// get the identity via param or stdin
     string identityJSON = "";
 	if (options[IDENTITY].count() > 0) {